@@ -1,10 +1,28 @@
 // to compile: cc -std=c99 -Wall parser.c mpc.c -ledit -lm -o parsing
 
+// hot lambdas get compiled to native code on x86-64 linux, which needs
+// mmap. build with -DTEDDY_NO_JIT to leave it out
+#if defined(__x86_64__) && defined(__linux__) && !defined(TEDDY_NO_JIT)
+#define TEDDY_JIT
+#define _DEFAULT_SOURCE
+#endif
+
 #include "mpc.h"
 #include "helpers.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <limits.h>
+
+#ifdef TEDDY_JIT
+#include <sys/mman.h>
+#endif
+
+// long sums add two at a time where the compiler has sse2
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 // if compiling on windows, compile these functions
 #ifdef _WIN32
@@ -32,8 +50,10 @@ void add_history(char* unused){}
 // some forward declarations
 struct lval;
 struct lenv;
+struct lcode;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lcode lcode;
 
 mpc_parser_t* Number;
 mpc_parser_t* Symbol; 
@@ -44,49 +64,200 @@ mpc_parser_t* Qexpr;
 mpc_parser_t* Expr;
 mpc_parser_t* Teddy;
 
-// lisp values
-enum { LVAL_LONG, LVAL_DOUBLE, LVAL_ERR, LVAL_STR, 
-    LVAL_SYM, LVAL_SEXPR, LVAL_QEXPR, LVAL_FUN };
+// lisp values. LVAL_FREE marks a pool slot that isn't holding a value
+enum { LVAL_FREE, LVAL_LONG, LVAL_DOUBLE, LVAL_ERR, LVAL_STR,
+    LVAL_SYM, LVAL_SEXPR, LVAL_QEXPR, LVAL_FUN, LVAL_MACRO };
 
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
+// a lisp value is a type tag plus a payload. only the member of the
+// union that matches the type is valid, so a number costs a tag and
+// a long instead of carrying every field of every other type.
+//
+// numbers are still boxed rather than tagged immediates. a number
+// result is one alloc and free from the lval pool, about 6ns. in a
+// counting loop that's 3 of the 4 allocations an iteration makes and
+// under a tenth of its time, and about 6% of (fib 25), which didn't
+// justify checking for an immediate at every use of an lval.
+//
+// in memory, a number is a 40 byte pool slot. it was an 88 byte
+// malloc, 96 with malloc's header, when every lval carried every
+// field. a list of distinct numbers takes 48 bytes a cell counting the
+// cell's pointer, down from 104. immediates would make that 8, which
+// is what cells sharing one number, like those join makes, cost now
 typedef struct lval {
-    int type;
-
-    long num_long;
-    double num_double;
-    char* err;
-    char* sym;
-    char* str;
-
-    lbuiltin builtin;
-    lenv* env;
-    lval* formals;
-    lval* body;
-
-    int count;
-    struct lval** cell;
+    unsigned char type;
+    unsigned char mark;   // set while the collector is tracing
+    unsigned char spec;   // what an s-expression has specialised to
+    int refs;             // number of owners sharing this value
+
+    union {
+        long num_long;
+        double num_double;
+        char* err;
+        char* str;
+
+        // symbols. depth and slot say where the binding was resolved
+        // to (see lval_resolve), or are -1. cache is the global value
+        // this symbol last found, good while lenv_version is still
+        // cache_version
+        struct {
+            char* sym;
+            int depth;
+            int slot;
+            lval* cache;
+            unsigned long cache_version;
+        };
+
+        // functions: builtin is NULL for user-defined lambdas. macros
+        // use the same fields, and are never builtins
+        struct {
+            lbuiltin builtin;
+            lenv* env;
+            lval* formals;
+            lval* body;
+        };
+
+        // s-expressions and q-expressions. code is the bytecode for a
+        // function body, once it has been compiled. expansion is set
+        // on a macro call once it has been expanded, holding the macro
+        // and what it expanded to (see lval_expand). calls counts calls
+        // to lambdas with this as their body, for the jit. spec (kept
+        // up in the header, where there is room) is the kind of call
+        // this s-expression has turned out to make (see lval_eval_code)
+        struct {
+            int count;
+            int calls;
+            struct lval** cell;
+            lcode* code;
+            struct lval* expansion;
+        };
+    };
 } lval;
 
+// bindings live in syms and vals in the order they were made. once an
+// env holds more than LENV_SMALL of them, index becomes an open
+// addressing table of positions keyed by symbol hash. small envs, like
+// function frames, are just scanned
+#define LENV_SMALL 8
+
 struct lenv {
     lenv* par;
     int count;
     char** syms;
     lval** vals;
+
+    int* index;
+    int index_cap;
+
+    int global;   // set on the top-level env
 };
 
+// object pools. every lval and lenv is carved out of a slab of fixed
+// size slots, and freed slots go on a free list to be handed out again,
+// so the hot constructors and destructors never touch malloc. compile
+// with -DTEDDY_MALLOC to fall back to plain malloc/free for debugging
+#ifdef __GNUC__
+#define TEDDY_THREAD_LOCAL __thread
+#else
+#define TEDDY_THREAD_LOCAL
+#endif
+
+#define POOL_SLAB_SLOTS 256
+
+typedef struct pool_slab {
+    struct pool_slab* next;
+    char* slots;
+} pool_slab;
+
+// a free slot keeps its next pointer at offset link, so a pool can
+// leave the start of its free slots readable (the collector relies on
+// lval slots still saying LVAL_FREE)
+typedef struct pool {
+    size_t size;
+    size_t link;
+    char* free;
+    pool_slab* slabs;
+} pool;
+
+#define POOL_NEXT(p, slot) (*(char**) ((slot) + (p)->link))
+
+// each thread keeps its own free lists, so no locking is needed
+TEDDY_THREAD_LOCAL pool lval_pool = {
+    sizeof(lval), offsetof(lval, cell), NULL, NULL };
+TEDDY_THREAD_LOCAL pool lenv_pool = { sizeof(lenv), 0, NULL, NULL };
+
+// adds a new, zeroed slab to the pool and threads its slots onto the
+// free list
+void pool_grow(pool* p) {
+    pool_slab* slab = malloc(sizeof(pool_slab));
+    slab->slots = calloc(POOL_SLAB_SLOTS, p->size);
+    slab->next = p->slabs;
+    p->slabs = slab;
+
+    for (int i = POOL_SLAB_SLOTS - 1; i >= 0; i--) {
+        char* slot = slab->slots + p->size * i;
+        POOL_NEXT(p, slot) = p->free;
+        p->free = slot;
+    }
+}
+
+void* pool_alloc(pool* p) {
+#ifdef TEDDY_MALLOC
+    return malloc(p->size);
+#else
+    if (!p->free) { pool_grow(p); }
+
+    char* slot = p->free;
+    p->free = POOL_NEXT(p, slot);
+    return slot;
+#endif
+}
+
+void pool_free(pool* p, void* ptr) {
+#ifdef TEDDY_MALLOC
+    free(ptr);
+#else
+    char* slot = ptr;
+    POOL_NEXT(p, slot) = p->free;
+    p->free = slot;
+#endif
+}
+
+// lvals handed out since the collector last ran
+long gc_allocs = 0;
+
+lval* lval_alloc(void) {
+    lval* v = pool_alloc(&lval_pool);
+    v->mark = 0;
+    v->refs = 1;
+    gc_allocs++;
+    return v;
+}
+
+void lval_free(lval* v) {
+    v->type = LVAL_FREE;
+    pool_free(&lval_pool, v);
+}
+
+lenv* lenv_alloc(void) { return pool_alloc(&lenv_pool); }
+void lenv_free(lenv* e) { pool_free(&lenv_pool, e); }
+
 lenv* lenv_new(void) {
-    lenv* e = malloc(sizeof(lenv));
+    lenv* e = lenv_alloc();
     e->par = NULL;
     e->count = 0;
     e->syms = NULL;
     e->vals = NULL;
+    e->index = NULL;
+    e->index_cap = 0;
+    e->global = 0;
     return e;
 }
 
 // pointer to a string lval
 lval* lval_str(char* s) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->type = LVAL_STR;
     v->str = malloc(strlen(s) + 1);
     strcpy(v->str, s);
@@ -95,7 +266,7 @@ lval* lval_str(char* s) {
 
 // pointer to a number lval
 lval* lval_num_long(long x) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->type = LVAL_LONG;
     v->num_long = x;
     return v;
@@ -103,7 +274,7 @@ lval* lval_num_long(long x) {
 
 // pointer to a double lval
 lval* lval_num_double(double x) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->type = LVAL_DOUBLE;
     v->num_double = x;
     return v;
@@ -111,7 +282,7 @@ lval* lval_num_double(double x) {
 
 // pointer to an error lval
 lval* lval_err(char* fmt, ...) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->type = LVAL_ERR;
 
     va_list va;
@@ -128,36 +299,118 @@ lval* lval_err(char* fmt, ...) {
     return v; 
 }
 
+// symbol names are interned: each name is stored once in a global
+// table, so symbols compare by pointer and their hash is worked out
+// only when the name is first read. an interned name lives forever
+typedef struct atom {
+    unsigned long hash;
+    char name[];
+} atom;
+
+atom** atoms = NULL;
+int atoms_count = 0;
+int atoms_cap = 0;
+
+// FNV-1a
+unsigned long str_hash(char* s) {
+    unsigned long h = 2166136261UL;
+    while (*s) {
+        h ^= (unsigned char) *s++;
+        h *= 16777619UL;
+    }
+    return h;
+}
+
+void atoms_grow(void) {
+    int old_cap = atoms_cap;
+    atom** old = atoms;
+
+    atoms_cap = atoms_cap ? atoms_cap * 2 : 256;
+    atoms = calloc(atoms_cap, sizeof(atom*));
+
+    for (int i = 0; i < old_cap; i++) {
+        if (!old[i]) { continue; }
+        int j = old[i]->hash & (atoms_cap - 1);
+        while (atoms[j]) { j = (j + 1) & (atoms_cap - 1); }
+        atoms[j] = old[i];
+    }
+    free(old);
+}
+
+// returns the one shared copy of the name s
+char* intern(char* s) {
+    if (atoms_count * 2 >= atoms_cap) { atoms_grow(); }
+
+    unsigned long h = str_hash(s);
+    int i = h & (atoms_cap - 1);
+    while (atoms[i]) {
+        if (atoms[i]->hash == h && strcmp(atoms[i]->name, s) == 0) {
+            return atoms[i]->name;
+        }
+        i = (i + 1) & (atoms_cap - 1);
+    }
+
+    atom* a = malloc(sizeof(atom) + strlen(s) + 1);
+    a->hash = h;
+    strcpy(a->name, s);
+    atoms[i] = a;
+    atoms_count++;
+    return a->name;
+}
+
+// the hash of an interned name, without rehashing it
+unsigned long sym_hash(char* sym) {
+    return ((atom*) (sym - offsetof(atom, name)))->hash;
+}
+
+// the interned "&" that marks variadic formals
+char* sym_amp(void) {
+    static char* amp = NULL;
+    if (!amp) { amp = intern("&"); }
+    return amp;
+}
+
 // pointer to a symbol lval
 lval* lval_sym(char* s) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->type = LVAL_SYM;
-    v->sym = malloc(strlen(s) + 1);
-    strcpy(v->sym, s);
+    v->sym = intern(s);
+    v->depth = -1;
+    v->slot = -1;
+    v->cache = NULL;
+    v->cache_version = 0;
     return v;
 }
 
 // pointer to a sexpr lval
 lval* lval_sexpr(void) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->type = LVAL_SEXPR;
+    v->spec = 0;
     v->count = 0;
+    v->calls = 0;
     v->cell = NULL;
+    v->code = NULL;
+    v->expansion = NULL;
     return v;
 }
 
 // pointer to empty qexpr lval
 lval* lval_qexpr(void) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->type = LVAL_QEXPR;
+    v->spec = 0;
     v->count = 0;
+    v->calls = 0;
     v->cell = NULL;
+    v->code = NULL;
+    v->expansion = NULL;
     return v;
 }
 
 // pointer to a function lval
 lval* lval_fun(lbuiltin func) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->type = LVAL_FUN;
     v->builtin = func;
     return v;
@@ -204,7 +457,8 @@ lval* lval_read_str(mpc_ast_t* t) {
     return str;
 }
 
-lval* lval_read(mpc_ast_t* t) {
+// reads a leaf of the tree, or creates the empty list for a branch
+lval* lval_read_node(mpc_ast_t* t) {
 
     // if it's a smybol or number, return the conversion of that type
     if (strstr(t->tag, "number")) { return lval_read_num(t); }
@@ -218,34 +472,68 @@ lval* lval_read(mpc_ast_t* t) {
     if (strcmp(t->tag, ">") == 0) { x = lval_sexpr(); }
     if (strstr(t->tag, "sexpr"))  { x = lval_sexpr(); }
     if (strstr(t->tag, "qexpr"))  { x = lval_qexpr(); }
+    return x;
+}
 
-    for (int i = 0; i < t->children_num; i++) {
-        if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
-        if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
-        if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
-        if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
-        if (strcmp(t->children[i]->tag,  "regex") == 0) { continue; }
-        if (strstr(t->children[i]->tag, "comment")) { continue; }
+// whether a child of a list node holds a value, rather than a bracket
+// or a comment
+int lval_read_skip(mpc_ast_t* t) {
+    if (strcmp(t->contents, "(") == 0) { return 1; }
+    if (strcmp(t->contents, ")") == 0) { return 1; }
+    if (strcmp(t->contents, "{") == 0) { return 1; }
+    if (strcmp(t->contents, "}") == 0) { return 1; }
+    if (strcmp(t->tag,  "regex") == 0) { return 1; }
+    if (strstr(t->tag, "comment")) { return 1; }
+    return 0;
+}
 
-        x = lval_add(x, lval_read(t->children[i]));
+// converts the tree to lvals without recursing. the stack holds the
+// lists being filled in and the next child to read into each
+lval* lval_read(mpc_ast_t* t) {
+    lval* root = lval_read_node(t);
+    if (!root || (root->type != LVAL_SEXPR && root->type != LVAL_QEXPR)) {
+        return root;
     }
 
-    return x;
-}
+    int cap = 16;
+    int count = 0;
+    mpc_ast_t** nodes = malloc(sizeof(mpc_ast_t*) * cap);
+    lval** lists = malloc(sizeof(lval*) * cap);
+    int* next = malloc(sizeof(int) * cap);
 
-void lval_print(lval* v);
+    nodes[count] = t; lists[count] = root; next[count++] = 0;
 
-void lval_expr_print(lval* v, char open, char close) {
-    putchar(open);
-    for (int i = 0; i < v->count; i++) {
-        lval_print(v->cell[i]);
+    while (count) {
+        mpc_ast_t* n = nodes[count-1];
+        int i = next[count-1]++;
+
+        if (i == n->children_num) {
+            count--;
+            continue;
+        }
 
-        // no trailing spaces if last element
-        if (i != (v->count-1)) {
-            putchar(' ');
+        mpc_ast_t* c = n->children[i];
+        if (lval_read_skip(c)) { continue; }
+
+        lval* x = lval_read_node(c);
+        lval_add(lists[count-1], x);
+
+        // the new list gets filled in before carrying on with this one
+        if (x && (x->type == LVAL_SEXPR || x->type == LVAL_QEXPR)) {
+            if (count == cap) {
+                cap *= 2;
+                nodes = realloc(nodes, sizeof(mpc_ast_t*) * cap);
+                lists = realloc(lists, sizeof(lval*) * cap);
+                next = realloc(next, sizeof(int) * cap);
+            }
+            nodes[count] = c; lists[count] = x; next[count++] = 0;
         }
     }
-    putchar(close);
+
+    free(nodes);
+    free(lists);
+    free(next);
+    return root;
 }
 
 void lval_print_str(lval* v) {
@@ -262,24 +550,77 @@ void lval_print_str(lval* v) {
     free(escaped);
 }
 
+// prints a value without recursing. each entry on the stack is a value
+// being printed and how many of its parts have been printed so far
 void lval_print(lval* v) {
-    switch(v->type) {
-        case LVAL_LONG:   printf("%li", v->num_long); break;
-        case LVAL_DOUBLE: printf("%lf", v->num_double); break;
-        case LVAL_SYM:    printf("%s", v->sym); break;
-        case LVAL_ERR:    printf("Error: %s", v->err); break;
-        case LVAL_SEXPR:  lval_expr_print(v, '(', ')'); break;
-        case LVAL_QEXPR:  lval_expr_print(v, '{', '}'); break;
-        case LVAL_STR:    lval_print_str(v); break;
-        case LVAL_FUN:    
-            if (v->builtin) {
-                printf("<builtin>");
-            } else {
-                printf("(\\ "); lval_print(v->formals);
-                putchar(' '); lval_print(v->body); putchar(')');
-            }
-        break;
+    int cap = 16;
+    int count = 0;
+    lval** vals = malloc(sizeof(lval*) * cap);
+    int* done = malloc(sizeof(int) * cap);
+
+    vals[count] = v;
+    done[count++] = -1;
+
+    while (count) {
+        v = vals[count-1];
+        int i = done[count-1]++;
+
+        // the next part to print, if any
+        lval* part = NULL;
+
+        switch(v->type) {
+            case LVAL_LONG:   printf("%li", v->num_long); break;
+            case LVAL_DOUBLE: printf("%lf", v->num_double); break;
+            case LVAL_SYM:    printf("%s", v->sym); break;
+            case LVAL_ERR:    printf("Error: %s", v->err); break;
+            case LVAL_STR:    lval_print_str(v); break;
+
+            case LVAL_SEXPR:
+            case LVAL_QEXPR:
+                if (i == -1) {
+                    putchar(v->type == LVAL_SEXPR ? '(' : '{');
+                }
+
+                // no trailing spaces after the last element
+                if (i + 1 < v->count) {
+                    if (i != -1) { putchar(' '); }
+                    part = v->cell[i+1];
+                } else {
+                    putchar(v->type == LVAL_SEXPR ? ')' : '}');
+                }
+            break;
+
+            case LVAL_FUN:
+            case LVAL_MACRO:
+                if (v->builtin) {
+                    printf("<builtin>");
+                } else if (i == -1) {
+                    printf(v->type == LVAL_FUN ? "(\\ " : "(macro ");
+                    part = v->formals;
+                } else if (i == 0) {
+                    putchar(' '); part = v->body;
+                } else {
+                    putchar(')');
+                }
+            break;
+        }
+
+        if (!part) {
+            count--;
+            continue;
+        }
+
+        if (count == cap) {
+            cap *= 2;
+            vals = realloc(vals, sizeof(lval*) * cap);
+            done = realloc(done, sizeof(int) * cap);
+        }
+        vals[count] = part;
+        done[count++] = -1;
     }
+
+    free(vals);
+    free(done);
 }
 
 // prints an lval, but with a newline after
@@ -290,9 +631,66 @@ lenv* lenv_copy(lenv* e);
 void lval_del(lval* v);
 void lenv_put(lenv* e, lval* k, lval* v);
 
-// copies an lval
+// bytecode for a function body. ops holds opcodes, each followed by
+// its operands, and consts the values the code refers to. max_depth is
+// how much value stack the code needs. a body can also have native
+// code from the jit, with or without bytecode (see jit_lambda), and a
+// folded body keeps what it was folded from (see lval_make_lambda)
+struct lcode {
+    int* ops;
+    int count;
+    int cap;
+
+    lval** consts;
+    int nconsts;
+
+    int depth;
+    int max_depth;
+
+    void* native;
+    size_t native_size;
+    int native_args;
+    int native_formals;         // const holding the formals it was made for
+    int native_guards;          // consts holding symbol, value pairs
+    int native_nguards;
+    unsigned long native_version;
+    int native_ok;              // whether the guards held at that version
+
+    int fold_body;              // const holding the body before folding
+    int fold_guards;            // consts holding symbol, value pairs
+    int fold_nguards;
+    unsigned long fold_version;
+    int fold_ok;                // whether the guards held at that version
+};
+
+void lcode_free_native(lcode* c) {
+#ifdef TEDDY_JIT
+    if (c->native) { munmap(c->native, c->native_size); }
+#endif
+}
+
+void lcode_del(lcode* c) {
+    for (int i = 0; i < c->nconsts; i++) {
+        lval_del(c->consts[i]);
+    }
+    lcode_free_native(c);
+    free(c->consts);
+    free(c->ops);
+    free(c);
+}
+
+// values are reference counted, so copying one just adds an owner.
+// anything that wants to change a value in place must call lval_mut
+// on it first, which makes a private copy if the value is shared
 lval* lval_copy(lval* v) {
-    lval* x = malloc(sizeof(lval));
+    v->refs++;
+    return v;
+}
+
+// copies the top level of an lval. children, bindings and the body of
+// a function are shared with the original rather than copied
+lval* lval_dup(lval* v) {
+    lval* x = lval_alloc();
     x->type = v->type;
 
     switch(v->type) {
@@ -300,6 +698,7 @@ lval* lval_copy(lval* v) {
         case LVAL_DOUBLE: x->num_double = v->num_double; break;
         case LVAL_LONG:   x->num_long = v->num_long; break;
         case LVAL_FUN:    
+        case LVAL_MACRO:
             if (v->builtin) {
                 x->builtin = v->builtin;
             } else {
@@ -318,14 +717,23 @@ lval* lval_copy(lval* v) {
             x->err = malloc(strlen(v->err) + 1);
             strcpy(x->err, v->err); break;
         
+        // symbols are interned, so share the name
         case LVAL_SYM:
-            x->sym = malloc(strlen(v->sym) + 1);
-            strcpy(x->sym, v->sym); break;
+            x->sym = v->sym;
+            x->depth = v->depth;
+            x->slot = v->slot;
+            x->cache = v->cache;
+            x->cache_version = v->cache_version;
+        break;
         
         case LVAL_QEXPR:
         case LVAL_SEXPR:
+            x->code = NULL;
+            x->expansion = NULL;
+            x->calls = 0;
+            x->spec = 0;
             x->count = v->count;
-            x->cell = malloc(sizeof(lval) * x->count);
+            x->cell = malloc(sizeof(lval*) * x->count);
             for (int i = 0; i < x->count; i++) {
                 x->cell[i] = lval_copy(v->cell[i]);
             }
@@ -335,7 +743,29 @@ lval* lval_copy(lval* v) {
     return x;
 }
 
-// takes first element from s-expression and shifts the rest into its place
+// takes ownership of v and returns a version of it that is safe to
+// change in place, copying it only when someone else still holds it
+lval* lval_mut(lval* v) {
+    if (v->refs == 1) {
+        // the caller is about to change it, so compiled code or an
+        // expansion for what it used to say is no good
+        if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+            if (v->code) { lcode_del(v->code); }
+            if (v->expansion) { lval_del(v->expansion); }
+            v->code = NULL;
+            v->expansion = NULL;
+            v->spec = 0;
+        }
+        return v;
+    }
+
+    lval* x = lval_dup(v);
+    v->refs--;
+    return x;
+}
+
+// takes first element from s-expression and shifts the rest into its place.
+// like lval_add, v must not be shared (see lval_mut)
 lval* lval_pop(lval* v, int i) {
     // get item at index i
     lval* x = v->cell[i];
@@ -357,18 +787,61 @@ lval* lval_take(lval* v, int i) {
     return x;
 }
 
+// takes the list v and returns one holding its cells from i up to j.
+// v's own cells are moved down when nothing else holds it, otherwise
+// the slice is copied out in one go, leaving v alone
+lval* lval_slice(lval* v, int i, int j) {
+    if (v->refs > 1) {
+        lval* x = v->type == LVAL_QEXPR ? lval_qexpr() : lval_sexpr();
+        x->count = j - i;
+        x->cell = malloc(sizeof(lval*) * x->count);
+        for (int k = i; k < j; k++) { x->cell[k-i] = lval_copy(v->cell[k]); }
+        v->refs--;
+        return x;
+    }
+
+    v = lval_mut(v);
+    for (int k = 0; k < i; k++) { lval_del(v->cell[k]); }
+    for (int k = j; k < v->count; k++) { lval_del(v->cell[k]); }
+    if (i) { memmove(v->cell, v->cell + i, sizeof(lval*) * (j - i)); }
+    v->count = j - i;
+    return v;
+}
+
+// takes the list y and puts its cells on the end of x, which has to
+// have room for them already. they're moved when y is only ours
+void lval_append(lval* x, lval* y) {
+    if (y->refs > 1) {
+        for (int i = 0; i < y->count; i++) {
+            x->cell[x->count++] = lval_copy(y->cell[i]);
+        }
+    } else if (y->count) {
+        memcpy(x->cell + x->count, y->cell, sizeof(lval*) * y->count);
+        x->count += y->count;
+        y->count = 0;
+    }
+    lval_del(y);
+}
+
 // copy an environment
 lenv* lenv_copy(lenv* e) {
-    lenv* n = malloc(sizeof(lenv));
+    lenv* n = lenv_alloc();
     n->par = e->par;
     n->count = e->count;
     n->syms = malloc(sizeof(char*) * n->count);
     n->vals = malloc(sizeof(lval*) * n->count);
     for (int i = 0; i < e->count; i++) {
-        n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-        strcpy(n->syms[i], e->syms[i]);
+        n->syms[i] = e->syms[i];
         n->vals[i] = lval_copy(e->vals[i]);
     }
+
+    n->global = e->global;
+    n->index_cap = e->index_cap;
+    n->index = NULL;
+    if (e->index) {
+        n->index = malloc(sizeof(int) * n->index_cap);
+        memcpy(n->index, e->index, sizeof(int) * n->index_cap);
+    }
     return n;
 }
 
@@ -383,39 +856,133 @@ void lenv_def(lenv* e, lval* k, lval* v) {
 // delete an environment
 void lenv_del(lenv* e) {
     for (int i = 0; i < e->count; i++) {
-        free(e->syms[i]);
         lval_del(e->vals[i]);
     }
     free(e->syms);
     free(e->vals);
-    free(e);
+    free(e->index);
+    lenv_free(e);
 }
 
-// get a lisp value from an environment
-lval* lenv_get(lenv* e, lval* k) {
+// records binding i in the index
+void lenv_index_add(lenv* e, int i) {
+    int mask = e->index_cap - 1;
+    int j = sym_hash(e->syms[i]) & mask;
+    while (e->index[j] != -1) { j = (j + 1) & mask; }
+    e->index[j] = i;
+}
+
+// rebuilds the index at twice the size it needs to be
+void lenv_reindex(lenv* e) {
+    e->index_cap = 16;
+    while (e->index_cap < e->count * 2) { e->index_cap *= 2; }
+
+    free(e->index);
+    e->index = malloc(sizeof(int) * e->index_cap);
+    memset(e->index, -1, sizeof(int) * e->index_cap);
+
     for (int i = 0; i < e->count; i++) {
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            return lval_copy(e->vals[i]);
+        lenv_index_add(e, i);
+    }
+}
+
+// position of the binding for sym in this env alone, or -1
+int lenv_find(lenv* e, char* sym) {
+    if (!e->index) {
+        for (int i = 0; i < e->count; i++) {
+            if (e->syms[i] == sym) { return i; }
         }
+        return -1;
     }
 
-    if (e->par) {
-        return lenv_get(e->par, k);
-    } else {
-        return lval_err("The symbol '%s' is not bound!", k->sym);
+    int mask = e->index_cap - 1;
+    int j = sym_hash(sym) & mask;
+    while (e->index[j] != -1) {
+        if (e->syms[e->index[j]] == sym) { return e->index[j]; }
+        j = (j + 1) & mask;
+    }
+    return -1;
+}
+
+// looks up a symbol resolved by lval_resolve. a call frame is flat,
+// its lambda's captures then its formals, with the global env as its
+// parent, so a hint is a slot at depth 0. a body can be shared by
+// lambdas whose frames are laid out differently, though, and each one
+// resolves the same symbols when it's made, so the hint is only
+// trusted if the binding is really there and no nearer frame binds
+// the name. returns NULL if the hint doesn't hold
+lval* lenv_get_resolved(lenv* e, lval* k) {
+    for (int d = k->depth; d > 0; d--) {
+        if (lenv_find(e, k->sym) != -1) { return NULL; }
+        e = e->par;
+        if (!e) { return NULL; }
+    }
+
+    if (k->slot < e->count && e->syms[k->slot] == k->sym) {
+        return e->vals[k->slot];
+    }
+    return NULL;
+}
+
+// inline caches. each symbol node remembers the global value it found
+// last time. any change to the global env bumps lenv_version, which
+// invalidates every cache at once
+unsigned long lenv_version = 1;
+long ic_hits = 0;
+long ic_misses = 0;
+
+lval* lenv_get_global(lenv* e, lval* k) {
+    if (k->cache_version == lenv_version) {
+        ic_hits++;
+        return k->cache;
+    }
+
+    ic_misses++;
+    int i = lenv_find(e, k->sym);
+    k->cache = i != -1 ? e->vals[i] : NULL;
+    k->cache_version = lenv_version;
+    return k->cache;
+}
+
+// borrows the value bound to k, or returns NULL if it isn't bound.
+// no reference is taken, so the value is only good until something
+// rebinds the name; take a copy to hold on to it
+lval* lenv_peek(lenv* e, lval* k) {
+    if (k->depth >= 0) {
+        lval* x = lenv_get_resolved(e, k);
+        if (x) { return x; }
+    }
+
+    while (e) {
+        if (e->global) { return lenv_get_global(e, k); }
+
+        int i = lenv_find(e, k->sym);
+        if (i != -1) { return e->vals[i]; }
+        e = e->par;
     }
+    return NULL;
+}
+
+// get a lisp value from an environment
+lval* lenv_get(lenv* e, lval* k) {
+    lval* x = lenv_peek(e, k);
+    if (x) { return lval_copy(x); }
+
+    return lval_err("The symbol '%s' is not bound!", k->sym);
 }
 
 // takes an env, a variable name, and a value. puts the variable into
 // the env as the value, or overwrites if it exists
 void lenv_put(lenv* e, lval* k, lval* v) {
-    for (int i = 0; i < e->count; i++) {
+    if (e->global) { lenv_version++; }
 
-        // if variable exists, delete and overwrite
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            lval_del(e->vals[i]);
-            e->vals[i] = lval_copy(v);
-        }
+    int i = lenv_find(e, k->sym);
+
+    // if variable exists, delete and overwrite
+    if (i != -1) {
+        lval_del(e->vals[i]);
+        e->vals[i] = lval_copy(v);
+        return;
     }
 
     // otherwise, make space and add it
@@ -424,49 +991,255 @@ void lenv_put(lenv* e, lval* k, lval* v) {
     e->syms = realloc(e->syms, sizeof(char*) * e->count);
 
     e->vals[e->count-1] = lval_copy(v);
-    e->syms[e->count-1] = malloc(strlen(k->sym)+1);
-    strcpy(e->syms[e->count-1], k->sym);
+    e->syms[e->count-1] = k->sym;
+
+    // index the env once it gets big, and keep it under half full
+    if (e->count > LENV_SMALL) {
+        if (e->count * 2 > e->index_cap) {
+            lenv_reindex(e);
+        } else {
+            lenv_index_add(e, e->count-1);
+        }
+    }
 }
 
-// this function deletes pointers to lvals
+// lvals waiting to be deleted. deleting a value can free a chain of
+// others, and doing that from a list rather than by recursion means a
+// deeply nested list can't overflow the C stack
+lval** del_stack = NULL;
+int del_stack_count = 0;
+int del_stack_cap = 0;
+int del_active = 0;
+
+// this function drops one owner of an lval, and deletes it once the
+// last owner is gone
 void lval_del(lval* v) {
+    if (--v->refs > 0) { return; }
+
+    if (del_stack_count == del_stack_cap) {
+        del_stack_cap = del_stack_cap ? del_stack_cap * 2 : 256;
+        del_stack = realloc(del_stack, sizeof(lval*) * del_stack_cap);
+    }
+    del_stack[del_stack_count++] = v;
+
+    // a delete further up is already working through the list
+    if (del_active) { return; }
+    del_active = 1;
+
+    while (del_stack_count) {
+        v = del_stack[--del_stack_count];
+
+        switch (v->type) {
+            // do nothing in the case of a number or double
+            case LVAL_LONG: break;
+            case LVAL_DOUBLE: break;
+            case LVAL_FUN: 
+            case LVAL_MACRO:
+                if (!v->builtin) {
+                    lenv_del(v->env);
+                    lval_del(v->formals);
+                    lval_del(v->body);
+                }
+            break;
+
+            case LVAL_STR: free(v->str); break;
+
+            // free the string for err. symbol names are interned
+            case LVAL_ERR: free(v->err); break;
+
+            // if sexpr or qexpr, delete all elements inside
+            case LVAL_QEXPR:
+            case LVAL_SEXPR:
+                for (int i = 0; i < v->count; i++) {
+                    lval_del(v->cell[i]);
+                }
+                // free memory allocated for pointers
+                free(v->cell);
+                if (v->code) { lcode_del(v->code); }
+                if (v->expansion) { lval_del(v->expansion); }
+            break;
+        }
+
+        // give the lval struct back to its pool
+        lval_free(v);
+    }
+
+    del_active = 0;
+}
+
+// mark and sweep collector. ownership still frees nearly everything
+// through lval_del, but a value dropped on the floor (an error path
+// that forgets its arguments, say) is unreachable from the global
+// environment and gets reclaimed here. it only runs between REPL lines,
+// where nothing is mid-evaluation and the global env is the only root
+#ifndef GC_THRESHOLD
+#define GC_THRESHOLD 65536
+#endif
+
+lval** gc_stack = NULL;
+int gc_stack_count = 0;
+int gc_stack_cap = 0;
+
+void gc_push(lval* v) {
+    if (v->mark) { return; }
+    v->mark = 1;
+
+    if (gc_stack_count == gc_stack_cap) {
+        gc_stack_cap = gc_stack_cap ? gc_stack_cap * 2 : 256;
+        gc_stack = realloc(gc_stack, sizeof(lval*) * gc_stack_cap);
+    }
+    gc_stack[gc_stack_count++] = v;
+}
+
+void gc_mark_env(lenv* e) {
+    for (int i = 0; i < e->count; i++) {
+        gc_push(e->vals[i]);
+    }
+}
+
+// marks everything reachable from the root, using an explicit stack so
+// deeply nested lists can't overflow the C stack
+void gc_mark(lenv* root) {
+    gc_mark_env(root);
+
+    while (gc_stack_count) {
+        lval* v = gc_stack[--gc_stack_count];
+
+        switch (v->type) {
+            case LVAL_FUN:
+            case LVAL_MACRO:
+                if (!v->builtin) {
+                    gc_mark_env(v->env);
+                    gc_push(v->formals);
+                    gc_push(v->body);
+                }
+            break;
+
+            case LVAL_QEXPR:
+            case LVAL_SEXPR:
+                for (int i = 0; i < v->count; i++) {
+                    gc_push(v->cell[i]);
+                }
+                if (v->code) {
+                    for (int i = 0; i < v->code->nconsts; i++) {
+                        gc_push(v->code->consts[i]);
+                    }
+                }
+                if (v->expansion) { gc_push(v->expansion); }
+            break;
+        }
+    }
+}
 
+// an unreachable lval can still share children with reachable ones,
+// and those lose an owner when it goes
+void gc_unref(lval* v) {
+    if (v->mark) { v->refs--; }
+}
+
+void gc_unref_children(lval* v) {
     switch (v->type) {
-        // do nothing in the case of a number or double
-        case LVAL_LONG: break;
-        case LVAL_DOUBLE: break;
-        case LVAL_FUN: 
+        case LVAL_FUN:
+        case LVAL_MACRO:
             if (!v->builtin) {
-                lenv_del(v->env);
-                lval_del(v->formals);
-                lval_del(v->body);
+                for (int i = 0; i < v->env->count; i++) {
+                    gc_unref(v->env->vals[i]);
+                }
+                gc_unref(v->formals);
+                gc_unref(v->body);
             }
         break;
 
-        case LVAL_STR: free(v->str); break;
+        case LVAL_QEXPR:
+        case LVAL_SEXPR:
+            for (int i = 0; i < v->count; i++) {
+                gc_unref(v->cell[i]);
+            }
+            if (v->code) {
+                for (int i = 0; i < v->code->nconsts; i++) {
+                    gc_unref(v->code->consts[i]);
+                }
+            }
+            if (v->expansion) { gc_unref(v->expansion); }
+        break;
+    }
+}
+
+// frees an unreachable lval without recursing. any unreachable lval it
+// points to gets freed by the sweep on its own
+void gc_free(lval* v) {
+    switch (v->type) {
+        case LVAL_FUN:
+        case LVAL_MACRO:
+            if (!v->builtin) {
+                free(v->env->syms);
+                free(v->env->vals);
+                free(v->env->index);
+                lenv_free(v->env);
+            }
+        break;
 
-        // free the string for err and sym
+        case LVAL_STR: free(v->str); break;
         case LVAL_ERR: free(v->err); break;
-        case LVAL_SYM: free(v->sym); break;
 
-        // if sexpr or qexpr, delete all elements inside
         case LVAL_QEXPR:
         case LVAL_SEXPR:
-            for (int i = 0; i < v->count; i++) {
-                lval_del(v->cell[i]);
-            }
-            // free memory allocated for pointers
             free(v->cell);
+            if (v->code) {
+                lcode_free_native(v->code);
+                free(v->code->consts);
+                free(v->code->ops);
+                free(v->code);
+            }
         break;
     }
 
-    // free memory allocated for lval struct
-    free(v);
+    lval_free(v);
+}
+
+int gc_sweep(void) {
+    int freed = 0;
+
+    // drop the references garbage holds on live values before any marks
+    // are cleared, then free the garbage
+    for (pool_slab* s = lval_pool.slabs; s; s = s->next) {
+        for (int i = 0; i < POOL_SLAB_SLOTS; i++) {
+            lval* v = (lval*) (s->slots + lval_pool.size * i);
+            if (v->type != LVAL_FREE && !v->mark) { gc_unref_children(v); }
+        }
+    }
+
+    for (pool_slab* s = lval_pool.slabs; s; s = s->next) {
+        for (int i = 0; i < POOL_SLAB_SLOTS; i++) {
+            lval* v = (lval*) (s->slots + lval_pool.size * i);
+
+            if (v->type == LVAL_FREE) { continue; }
+            if (v->mark) { v->mark = 0; continue; }
+
+            gc_free(v);
+            freed++;
+        }
+    }
+
+    return freed;
+}
+
+// collects garbage and returns how many lvals were reclaimed. with
+// TEDDY_MALLOC there are no slabs to sweep, so this does nothing
+int gc_collect(lenv* root) {
+#ifdef TEDDY_MALLOC
+    return 0;
+#else
+    gc_mark(root);
+    int freed = gc_sweep();
+    gc_allocs = 0;
+    return freed;
+#endif
 }
 
 // user-defined function
 lval* lval_lambda(lval* formals, lval* body) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->type = LVAL_FUN;
 
     v->builtin = NULL;
@@ -479,6 +1252,17 @@ lval* lval_lambda(lval* formals, lval* body) {
 }
 
 lval* lval_eval_sexpr(lenv* e, lval* v);
+lval* lval_eval_stack(lenv* e, lval* v, lval* fn);
+
+// when this is above 0, s-expressions are evaluated by lval_eval_stack
+// with at most this many entries on its stack, and so are the bodies
+// of lambdas that builtins like map call. at 0, they're evaluated by
+// recursion on the C stack
+#ifndef EVAL_STACK_LIMIT
+#define EVAL_STACK_LIMIT 0
+#endif
+
+int eval_limit = EVAL_STACK_LIMIT;
 
 lval* lval_eval(lenv* e, lval* v) {
     // check the environment for the lval first, and get it's
@@ -490,80 +1274,158 @@ lval* lval_eval(lenv* e, lval* v) {
     }
 
     // otherwise, evaluate the s-expression or simply return the value
-    if (v->type == LVAL_SEXPR) { return lval_eval_sexpr(e, v); }
+    if (v->type == LVAL_SEXPR) {
+        return eval_limit ? lval_eval_stack(e, v, NULL) : lval_eval_sexpr(e, v);
+    }
 
     return v;
 }
 
-lval* builtin_op(lenv* e, lval* a, char* op) {
+// the arithmetic, ordering and equality operators. each builtin passes
+// its own to builtin_op, builtin_ord or builtin_cmp, which run the
+// kernel for it
+enum { NUM_ADD, NUM_SUB, NUM_MUL, NUM_DIV, NUM_MOD, NUM_POW,
+    NUM_GT, NUM_LT, NUM_GTE, NUM_LTE, NUM_EQ, NUM_NE };
+
+char* num_names[] = { "+", "-", "*", "/", "%", "^", ">", "<", ">=", "<=",
+    "==", "!=" };
+
+// x op y for two longs, into *r. dividing by -1 is done as negating,
+// since LONG_MIN / -1 traps
+lval* op_long(int op, long x, long y, long* r) {
+    switch (op) {
+        case NUM_ADD: *r = x + y; break;
+        case NUM_SUB: *r = x - y; break;
+        case NUM_MUL: *r = x * y; break;
+        case NUM_DIV:
+        case NUM_MOD:
+            if (y == 0) {
+                return lval_err("Are you serious? You can't divide by zero!");
+            }
+            if (y == -1) {
+                *r = op == NUM_DIV ? (long) (0UL - (unsigned long) x) : 0;
+            } else {
+                *r = op == NUM_DIV ? x / y : x % y;
+            }
+        break;
+        case NUM_POW: *r = power(x, y); break;
+    }
+    return NULL;
+}
+
+// x op y for two doubles, into *r
+lval* op_double(int op, double x, double y, double* r) {
+    switch (op) {
+        case NUM_ADD: *r = x + y; break;
+        case NUM_SUB: *r = x - y; break;
+        case NUM_MUL: *r = x * y; break;
+        case NUM_DIV:
+            if (y == 0) {
+                return lval_err("Are you serious? You can't divide by zero!");
+            }
+            *r = x / y;
+        break;
+        case NUM_MOD: return lval_err("You can't use modulo with doubles!");
+        case NUM_POW: *r = power(x, y); break;
+    }
+    return NULL;
+}
+
+// the sum of the longs in the n values at cells. sums wrap the same
+// whichever order they're added in, so this can go two lanes at a time
+long sum_longs(lval** cells, int n) {
+    long r = 0;
+    int i = 0;
+
+#ifdef __SSE2__
+    __m128i s0 = _mm_setzero_si128();
+    __m128i s1 = _mm_setzero_si128();
+    for (; i + 4 <= n; i += 4) {
+        s0 = _mm_add_epi64(s0,
+            _mm_set_epi64x(cells[i+1]->num_long, cells[i]->num_long));
+        s1 = _mm_add_epi64(s1,
+            _mm_set_epi64x(cells[i+3]->num_long, cells[i+2]->num_long));
+    }
+    long lanes[2];
+    _mm_storeu_si128((__m128i*) lanes, _mm_add_epi64(s0, s1));
+    r = lanes[0] + lanes[1];
+#endif
+
+    for (; i < n; i++) { r += cells[i]->num_long; }
+    return r;
+}
+
+lval* builtin_op(lenv* e, lval* a, int op) {
 
     // check if all arguments are numbers, throw error if not
+    int longs = 1;
     for (int i = 0; i < a->count; i++) {
-        if (a->cell[i]->type != LVAL_DOUBLE && a->cell[i]->type != LVAL_LONG) {
+        int t = a->cell[i]->type;
+        if (t != LVAL_DOUBLE && t != LVAL_LONG) {
             lval_del(a);
             return lval_err("You need to give me numbers!");
         }
+        longs = longs && t == LVAL_LONG;
     }
 
-    lval* x = lval_pop(a, 0);
+    // the running result stays a long until it meets a double, and
+    // from then on is a double
+    lval* x = a->cell[0];
+    int is_double = x->type == LVAL_DOUBLE;
+    long l = is_double ? 0 : x->num_long;
+    double d = is_double ? x->num_double : 0;
 
-    if ((strcmp(op, "-") == 0) && a->count == 0) {
-        if (x->type == LVAL_DOUBLE) {
-            x->num_double = -x->num_double;
-        } else if (x->type == LVAL_LONG) {
-            x->num_long = -x->num_long;
-        }
+    if (op == NUM_SUB && a->count == 1) {
+        l = -l;
+        d = -d;
     }
 
-    while (a->count > 0) {
-
-        lval* y = lval_pop(a, 0);
+    // adding up longs, or taking them away from the first, is one sum.
+    // doubles go one at a time, since their rounding depends on order
+    int start = 1;
+    if (longs && (op == NUM_ADD || op == NUM_SUB) && a->count > 1) {
+        long sum = sum_longs(a->cell + 1, a->count - 1);
+        l = op == NUM_ADD ? l + sum : l - sum;
+        start = a->count;
+    }
 
-        if (x->type == LVAL_DOUBLE || y->type == LVAL_DOUBLE) {
-            if (x->type == LVAL_LONG) { double x_double = x->num_long; x->type = LVAL_DOUBLE; x->num_double = x_double; }
-            if (y->type == LVAL_LONG) { double y_double = y->num_long; y->type = LVAL_DOUBLE; y->num_double = y_double; }
-            if (strcmp(op, "+") == 0) { x->num_double += y->num_double; }
-            if (strcmp(op, "-") == 0) { x->num_double -= y->num_double; }
-            if (strcmp(op, "*") == 0) { x->num_double *= y->num_double; }
-            if (strcmp(op, "/") == 0) { 
-                if (y->num_double == 0) {
-                    lval_del(x); lval_del(y);
-                    x = lval_err("Are you serious? You can't divide by zero!");
-                    break;
-                } 
-                x->num_double = y->num_double;
-            }
-            if (strcmp(op, "%") == 0) {
-                lval_del(x); lval_del(y);
-                x = lval_err("You can't use modulo with doubles!");
-                break;
-            }
-	    if (strcmp(op, "^") == 0) { x->num_double = power(x->num_double, y->num_double); }
-        } else if (y->type == LVAL_LONG) {
-            if (strcmp(op, "+") == 0) { x->num_long += y->num_long; }
-            if (strcmp(op, "-") == 0) { x->num_long -= y->num_long; }
-            if (strcmp(op, "*") == 0) { x->num_long *= y->num_long; }
-            if (strcmp(op, "/") == 0) { 
-                if (y->num_long == 0) {
-                    lval_del(x); lval_del(y);
-                    x = lval_err("Are you serious? You can't divide by zero!");
-                    break;
-                } 
-                x->num_long = y->num_long;
-            }
-            if (strcmp(op, "%") == 0) { x->num_long = x->num_long % y->num_long; }
-	    if (strcmp(op, "^") == 0) { x->num_long = power(x->num_long, y->num_long); }
+    lval* err = NULL;
+    for (int i = start; i < a->count && !err; i++) {
+        lval* y = a->cell[i];
+        if (!is_double && y->type == LVAL_LONG) {
+            err = op_long(op, l, y->num_long, &l);
+            continue;
         }
-        lval_del(y);
+        if (!is_double) {
+            d = (double) l;
+            is_double = 1;
+        }
+        double z = y->type == LVAL_LONG ? (double) y->num_long : y->num_double;
+        err = op_double(op, d, z, &d);
     }
 
-    lval_del(a);
+    if (err) {
+        lval_del(a);
+        return err;
+    }
+
+    // the first argument holds the result, copied if it is shared
+    x = lval_mut(lval_pop(a, 0));
+    lval_del(a);
+    if (is_double) {
+        x->type = LVAL_DOUBLE;
+        x->num_double = d;
+    } else {
+        x->type = LVAL_LONG;
+        x->num_long = l;
+    }
     return x;
 }
 
 char* ltype_name(int t) {
     switch(t) {
 	case LVAL_FUN: return "Function";
+	case LVAL_MACRO: return "Macro";
 	case LVAL_ERR: return "Error";
 	case LVAL_SYM: return "Symbol";
 	case LVAL_DOUBLE:
@@ -602,6 +1464,21 @@ char* ltype_name(int t) {
 
 
 
+// constants made by defconst. the names can't be bound again, by def,
+// = or as formals, so their values can go straight into code
+lenv* consts = NULL;
+
+// an error if any of the symbols in syms is a constant
+lval* lval_const_check(lval* syms) {
+    for (int i = 0; consts && i < syms->count; i++) {
+        if (lenv_find(consts, syms->cell[i]->sym) != -1) {
+            return lval_err("Can't bind '%s', it's a constant!",
+                syms->cell[i]->sym);
+        }
+    }
+    return NULL;
+}
+
 lval* builtin_var(lenv* e, lval* a, char* func) {
     LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
 
@@ -616,6 +1493,12 @@ lval* builtin_var(lenv* e, lval* a, char* func) {
     LASSERT(a, (syms->count == a->count - 1),
     "You gave %s too many arguments for symbols! Got %i, expected %i!", func, syms->count, a->count-1);
 
+    lval* err = lval_const_check(syms);
+    if (err) {
+        lval_del(a);
+        return err;
+    }
+
     for (int i = 0; i < syms->count; i++) {
         if (strcmp(func, "def") == 0) {
             lenv_def(e, syms->cell[i], a->cell[i+1]);
@@ -624,6 +1507,12 @@ lval* builtin_var(lenv* e, lval* a, char* func) {
         if (strcmp(func, "=") == 0) {
             lenv_put(e, syms->cell[i], a->cell[i+1]);
         }
+
+        if (strcmp(func, "defconst") == 0) {
+            lenv_def(e, syms->cell[i], a->cell[i+1]);
+            if (!consts) { consts = lenv_new(); }
+            lenv_put(consts, syms->cell[i], a->cell[i+1]);
+        }
     }
 
     lval_del(a);
@@ -638,6 +1527,12 @@ lval* builtin_put(lenv* e, lval* a) {
     return builtin_var(e, a, "=");
 }
 
+// like def, but the names can never be bound again, and their values
+// get folded into code that uses them
+lval* builtin_defconst(lenv* e, lval* a) {
+    return builtin_var(e, a, "defconst");
+}
+
 lval* builtin_head(lenv* e, lval* a) {
     // error conditions
     LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
@@ -651,9 +1546,13 @@ lval* builtin_head(lenv* e, lval* a) {
     LASSERT(a, a->count != 0, 
         "You passed 'head' an empty list!");
 
-    lval* v = lval_take(a, 0);
+    // only reads the list, so it can stay shared
+    lval* v = lval_qexpr();
+    if (a->cell[0]->count) {
+        lval_add(v, lval_copy(a->cell[0]->cell[0]));
+    }
 
-    while (v->count > 1) { lval_del(lval_pop(v, 1)); }
+    lval_del(a);
     return v;
 }
 
@@ -668,11 +1567,9 @@ lval* builtin_tail(lenv* e, lval* a) {
     LASSERT(a, a->count != 0, 
         "You passed 'tail' an empty list!");
 
+    // everything but the first element, or {} if there isn't one
     lval* v = lval_take(a, 0);
-
-    // delete first element and return the rest
-    lval_del(lval_pop(v, 0));
-    return v;    
+    return v->count ? lval_slice(v, 1, v->count) : v;
 }
 
 lval* builtin_list(lenv* e, lval* a) {
@@ -680,39 +1577,49 @@ lval* builtin_list(lenv* e, lval* a) {
     return a;
 }
 
-lval* builtin_eval(lenv* e, lval* a) {
+// checks the arguments to eval and returns the q-expression it was
+// given, untouched
+lval* eval_pick(lval* a) {
     LASSERT(a, a->count == 1, 
     "You gave 'eval' too many arguments!");
     LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
         "You gave 'eval' the wrong type!");
     
-    lval* x = lval_take(a, 0);
-    x->type = LVAL_SEXPR;
-    return lval_eval(e, x);
+    return lval_take(a, 0);
 }
 
-lval* lval_join(lval* x, lval* y) {
-    while (y->count) {
-        x = lval_add(x, lval_pop(y, 0));
-    }
+// as eval_pick, but as an s-expression ready to evaluate
+lval* eval_expr(lval* a) {
+    lval* x = eval_pick(a);
+    if (x->type == LVAL_ERR) { return x; }
 
-    // delete now empty y and return x
-    lval_del(y);
+    x = lval_mut(x);
+    x->type = LVAL_SEXPR;
     return x;
 }
 
+lval* builtin_eval(lenv* e, lval* a) {
+    return lval_eval(e, eval_expr(a));
+}
+
 lval* builtin_join(lenv* e, lval* a) {
+    int count = 0;
     for (int i = 0; i < a->count; i++) {
         LASSERT(a, a->cell[i]->type == LVAL_QEXPR,
             "You gave 'join' the wrong thing!");
+        count += a->cell[i]->count;
     }
-
-    lval* x = lval_pop(a, 0);
-
-    while (a->count) {
-        x = lval_join(x, lval_pop(a, 0));
+    if (a->count == 0) {
+        lval_del(a);
+        return lval_qexpr();
     }
 
+    // the first list grows once to hold all of them
+    lval* x = lval_mut(a->cell[0]);
+    x->cell = realloc(x->cell, sizeof(lval*) * count);
+    for (int i = 1; i < a->count; i++) { lval_append(x, a->cell[i]); }
+
+    a->count = 0;
     lval_del(a);
     return x;
 }
@@ -741,86 +1648,94 @@ lval* builtin_init(lenv* e, lval* a) {
     LASSERT(a, a->count != 0, 
         "You passed 'init' an empty list!");
 
+    // everything but the last element, or {} if there isn't one
     lval* v = lval_take(a, 0);
-
-    lval_del(lval_pop(v, v->count - 1));
-    lval_del(a);
-
-    return v;
+    return v->count ? lval_slice(v, 0, v->count - 1) : v;
 }
 
 lval* builtin_cons(lenv* e, lval* a) {
-    LASSERT(a, a->count == 2,
+    LASSERT(a, a->count == 2 && a->cell[1]->type == LVAL_QEXPR,
         "Function 'cons' needs one value and one list!");
     LASSERT(a, a->cell[0]->type != LVAL_QEXPR,
         "Function 'cons' takes a simple value as a first argument, not a list!")
 
     lval* b = lval_qexpr();
-    lval_add(b, lval_pop(a, 0));
-    
-    int i = 0;
-    while(i <= a->count) {
-        while (a->cell[i]->count) {
-            lval_add(b, lval_pop(a->cell[i], 0));
-        }
-        i++;
-    }
+    b->cell = malloc(sizeof(lval*) * (1 + a->cell[1]->count));
+    b->cell[b->count++] = a->cell[0];
+    lval_append(b, a->cell[1]);
 
+    a->count = 0;
+    lval_del(a);
     return b;
 }
 
 lval* builtin_add(lenv* e, lval* a) {
-    return builtin_op(e, a, "+");
+    return builtin_op(e, a, NUM_ADD);
 }
 
 lval* builtin_sub(lenv* e, lval* a) {
-    return builtin_op(e, a, "-");
+    return builtin_op(e, a, NUM_SUB);
 }
 
 lval* builtin_mul(lenv* e, lval* a) {
-    return builtin_op(e, a, "*");
+    return builtin_op(e, a, NUM_MUL);
 }
 
 lval* builtin_div(lenv* e, lval* a) {
-    return builtin_op(e, a, "/");
+    return builtin_op(e, a, NUM_DIV);
 }
 
 lval* builtin_mod(lenv* e, lval* a) {
-    return builtin_op(e, a, "%");
+    return builtin_op(e, a, NUM_MOD);
 }
 
 lval* builtin_pow(lenv* e, lval* a) {
-    return builtin_op(e, a, "^");
+    return builtin_op(e, a, NUM_POW);
 }
 
-lval* builtin_ord(lenv* e, lval* a, char* op) {
-    LASSERT_NUM(op, a, 2);
-    
-    if (a->cell[0]->num_long) {
-        a->cell[0]->num_double = (double) a->cell[0]->num_long;
-        a->cell[0]->type = LVAL_DOUBLE;
+// x op y for an ordering operator. longs compare as longs, so the
+// comparison is exact however big they are
+int ord_long(int op, long x, long y) {
+    switch (op) {
+        case NUM_GT:  return x > y;
+        case NUM_LT:  return x < y;
+        case NUM_GTE: return x >= y;
+        case NUM_LTE: return x <= y;
     }
+    return 0;
+}
 
-    if (a->cell[1]->num_long) {
-        a->cell[1]->num_double = (double) a->cell[1]->num_long;
-        a->cell[1]->type = LVAL_DOUBLE;
+int ord_double(int op, double x, double y) {
+    switch (op) {
+        case NUM_GT:  return x > y;
+        case NUM_LT:  return x < y;
+        case NUM_GTE: return x >= y;
+        case NUM_LTE: return x <= y;
     }
+    return 0;
+}
 
-    LASSERT_TYPE(op, a, 0, LVAL_DOUBLE);
-    LASSERT_TYPE(op, a, 1, LVAL_DOUBLE);
+lval* builtin_ord(lenv* e, lval* a, int op) {
+    char* name = num_names[op];
+    LASSERT_NUM(name, a, 2);
 
-    int r;
-    if (strcmp(op, ">") == 0) {
-        r = (a->cell[0]->num_double > a->cell[1]->num_double);
+    for (int i = 0; i < 2; i++) {
+        int t = a->cell[i]->type;
+        LASSERT(a, t == LVAL_LONG || t == LVAL_DOUBLE,
+            "Function '%s' passed incorrect type for argument %i. "
+            "Got %s, Expected %s.",
+            name, i, ltype_name(t), ltype_name(LVAL_DOUBLE));
     }
-    if (strcmp(op, "<") == 0) {
-        r = (a->cell[0]->num_double < a->cell[1]->num_double);
-    }
-    if (strcmp(op, ">=") == 0) {
-        r = (a->cell[0]->num_double >= a->cell[1]->num_double);
-    }
-    if (strcmp(op, "<=") == 0) {
-        r = (a->cell[0]->num_double <= a->cell[1]->num_long);
+
+    lval* x = a->cell[0];
+    lval* y = a->cell[1];
+    int r;
+    if (x->type == LVAL_LONG && y->type == LVAL_LONG) {
+        r = ord_long(op, x->num_long, y->num_long);
+    } else {
+        r = ord_double(op,
+            x->type == LVAL_LONG ? (double) x->num_long : x->num_double,
+            y->type == LVAL_LONG ? (double) y->num_long : y->num_double);
     }
 
     lval_del(a);
@@ -828,106 +1743,164 @@ lval* builtin_ord(lenv* e, lval* a, char* op) {
 }
 
 lval* builtin_gt(lenv* e, lval* a) {
-    return builtin_ord(e, a, ">");
+    return builtin_ord(e, a, NUM_GT);
 }
 
 lval* builtin_lt(lenv* e, lval* a) {
-    return builtin_ord(e, a, "<");
+    return builtin_ord(e, a, NUM_LT);
 }
 
 lval* builtin_gte(lenv* e, lval* a) {
-    return builtin_ord(e, a, ">=");
+    return builtin_ord(e, a, NUM_GTE);
 }
 
 lval* builtin_lte(lenv* e, lval* a) {
-    return builtin_ord(e, a, "<=");
+    return builtin_ord(e, a, NUM_LTE);
 }
 
 
+// compares two values without recursing: pairs of elements still to
+// compare wait on a stack
 int lval_eq(lval* x, lval* y) {
-    // different types are always !=
-    if (x->type != y->type) { return 0; }
-
-    // compare types
-    switch (x->type) {
-        // compare number values
-        case LVAL_LONG: return (x->num_long == y->num_long);
-        case LVAL_DOUBLE: return (x->num_double == y->num_double);
-
-        // compare string values
-        case LVAL_ERR: return (strcmp(x->err, y->err) == 0);
-        case LVAL_SYM: return (strcmp(x->sym, y->sym) == 0);
-        case LVAL_STR: return (strcmp(x->str, y->str) == 0);
+    int cap = 16;
+    int count = 0;
+    lval** pairs = malloc(sizeof(lval*) * cap);
+    int eq = 1;
+
+    for (;;) {
+        // different types are always !=
+        if (x->type != y->type) { eq = 0; break; }
+
+        // compare types
+        switch (x->type) {
+            // compare number values
+            case LVAL_LONG: eq = (x->num_long == y->num_long); break;
+            case LVAL_DOUBLE: eq = (x->num_double == y->num_double); break;
+
+            // compare string values
+            case LVAL_ERR: eq = (strcmp(x->err, y->err) == 0); break;
+            case LVAL_SYM: eq = (x->sym == y->sym); break;
+            case LVAL_STR: eq = (strcmp(x->str, y->str) == 0); break;
+
+            // compare builtins, otherwise compare body and formals
+            case LVAL_FUN:
+            case LVAL_MACRO:
+                if (x->builtin || y->builtin) {
+                    eq = x->builtin == y->builtin;
+                    break;
+                }
+
+                if (count + 4 > cap) {
+                    cap *= 2;
+                    pairs = realloc(pairs, sizeof(lval*) * cap);
+                }
+                pairs[count++] = x->formals; pairs[count++] = y->formals;
+                pairs[count++] = x->body; pairs[count++] = y->body;
+            break;
 
-        // compare builtins, otherwise compare body and formals
-        case LVAL_FUN:
-            if (x->builtin || y->builtin) {
-                return x->builtin == y->builtin;
-            } else {
-                return lval_eq(x->formals, y->formals)
-                    && lval_eq(x->body, y->body);
-            }
+            // if it's a list, compare all the elements
+            case LVAL_QEXPR:
+            case LVAL_SEXPR:
+                if (x->count != y->count) { eq = 0; break; }
+
+                while (count + x->count * 2 > cap) { cap *= 2; }
+                pairs = realloc(pairs, sizeof(lval*) * cap);
+                for (int i = x->count - 1; i >= 0; i--) {
+                    pairs[count++] = x->cell[i];
+                    pairs[count++] = y->cell[i];
+                }
+            break;
+        }
 
-        // if it's a list, compare all the elements
-        case LVAL_QEXPR:
-        case LVAL_SEXPR:
-            if (x->count != y->count) { return 0; }
-            for (int i = 0; i < x->count; i++) {
-                // return 0 if any element is not equal
-                if (!lval_eq(x->cell[i], y->cell[i])) { return 0; }
-            }
-            // if it makes it through the loop, the lists must be equal
-            return 1;
-        break;
+        // stop at the first difference, or once nothing is left
+        if (!eq || !count) { break; }
+        y = pairs[--count];
+        x = pairs[--count];
     }
-    return 0;
+
+    free(pairs);
+    return eq;
 }
 
-lval* builtin_cmp(lenv* e, lval* a, char* op) {
-    LASSERT_NUM(op, a, 2);
-    int r;
+lval* builtin_cmp(lenv* e, lval* a, int op) {
+    LASSERT_NUM(num_names[op], a, 2);
 
-    if (strcmp(op, "==") == 0) {
-        r = lval_eq(a->cell[0], a->cell[1]);
-    }
-    if (strcmp(op, "!=") == 0) {
-        r = !lval_eq(a->cell[0], a->cell[1]);
-    }
+    int r = lval_eq(a->cell[0], a->cell[1]);
+    if (op == NUM_NE) { r = !r; }
 
     lval_del(a);
     return lval_num_long(r);
 }
 
 lval* builtin_eq(lenv* e, lval* a) {
-    return builtin_cmp(e, a, "==");
+    return builtin_cmp(e, a, NUM_EQ);
 }
 
 lval* builtin_ne(lenv* e, lval* a) {
-    return builtin_cmp(e, a, "!=");
+    return builtin_cmp(e, a, NUM_NE);
 }
 
-lval* builtin_if(lenv* e, lval* a) {
+// the two-argument builtins that specialised calls and compiled code
+// work out on longs directly. spec_builtins is indexed by spec kind
+enum { SPEC_NONE, SPEC_GENERIC, SPEC_ADD, SPEC_SUB, SPEC_MUL,
+    SPEC_LT, SPEC_GT, SPEC_LTE, SPEC_GTE, SPEC_EQ, SPEC_NE, SPEC_COUNT };
+
+lbuiltin spec_builtins[SPEC_COUNT] = { NULL, NULL,
+    builtin_add, builtin_sub, builtin_mul,
+    builtin_lt, builtin_gt, builtin_lte, builtin_gte, builtin_eq, builtin_ne };
+
+// the spec kind for calling b with two longs, or SPEC_GENERIC
+int spec_kind(lbuiltin b) {
+    for (int i = SPEC_ADD; i < SPEC_COUNT; i++) {
+        if (spec_builtins[i] == b) { return i; }
+    }
+    return SPEC_GENERIC;
+}
+
+// what b gives for the longs x and y, as builtin_op and friends would
+// work it out. returns 0 if b isn't one of the builtins above
+int builtin_long_op(lbuiltin b, long x, long y, long* r) {
+    switch (spec_kind(b)) {
+        case SPEC_ADD: *r = x + y; return 1;
+        case SPEC_SUB: *r = x - y; return 1;
+        case SPEC_MUL: *r = x * y; return 1;
+        case SPEC_LT:  *r = x <  y; return 1;
+        case SPEC_GT:  *r = x >  y; return 1;
+        case SPEC_LTE: *r = x <= y; return 1;
+        case SPEC_GTE: *r = x >= y; return 1;
+        case SPEC_EQ:  *r = x == y; return 1;
+        case SPEC_NE:  *r = x != y; return 1;
+    }
+    return 0;
+}
+
+// checks the arguments to if and returns the q-expression for the
+// branch it picks, untouched
+lval* if_pick(lval* a) {
     LASSERT_NUM("if", a, 3);
     LASSERT_TYPE("if", a, 0, LVAL_LONG);
     LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
     LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
 
-    lval* x;
-    a->cell[1]->type = LVAL_SEXPR;
-    a->cell[2]->type = LVAL_SEXPR;
+    // if the condition is true, take the first expression, otherwise
+    // take the second
+    return lval_take(a, a->cell[0]->num_long ? 1 : 2);
+}
 
-    if (a->cell[0]->num_long || a->cell[0]->num_double) {
-        // if the condition is true, evaluate the first expression
-        x = lval_eval(e, lval_pop(a, 1));
-    } else{
-        // otherwise evaluate the second expression
-        x = lval_eval(e, lval_pop(a, 2));
-    }
+// as if_pick, but as an s-expression ready to evaluate
+lval* if_branch(lval* a) {
+    lval* x = if_pick(a);
+    if (x->type == LVAL_ERR) { return x; }
 
-    lval_del(a);
+    x = lval_mut(x);
+    x->type = LVAL_SEXPR;
     return x;
 }
 
+lval* builtin_if(lenv* e, lval* a) {
+    return lval_eval(e, if_branch(a));
+}
+
 lval* builtin_printall(lenv* e, lval* a) {
     for (int i = 0; i < e->count; i++) {
         printf("%d. %s\n", i+1, e->syms[i]);
@@ -936,6 +1909,21 @@ lval* builtin_printall(lenv* e, lval* a) {
     return lval_sexpr();
 }
 
+// switches to the explicit stack evaluator, with at most the given
+// number of entries on its stack, or back to the recursive one with 0.
+// returns the limit there was before
+lval* builtin_stackeval(lenv* e, lval* a) {
+    LASSERT_NUM("stackeval", a, 1);
+    LASSERT_TYPE("stackeval", a, 0, LVAL_LONG);
+    LASSERT(a, a->cell[0]->num_long >= 0 && a->cell[0]->num_long <= INT_MAX,
+        "Function 'stackeval' needs a limit from 0 to %i!", INT_MAX);
+
+    lval* x = lval_num_long(eval_limit);
+    eval_limit = a->cell[0]->num_long;
+    lval_del(a);
+    return x;
+}
+
 lval* builtin_error(lenv* e, lval* a) {
     LASSERT_NUM("error", a, 1);
     LASSERT_TYPE("error", a, 0, LVAL_STR);
@@ -947,6 +1935,279 @@ lval* builtin_error(lenv* e, lval* a) {
     return err;
 }
 
+// a call frame holds the lambda's captured variables followed by its
+// formals in order, skipping '&'. this is where a formal ends up among
+// the formals, or -1
+int formal_slot(lval* formals, char* sym) {
+    int slot = 0;
+    for (int i = 0; i < formals->count; i++) {
+        if (formals->cell[i]->sym == sym_amp()) { continue; }
+        if (formals->cell[i]->sym == sym) { return slot; }
+        slot++;
+    }
+    return -1;
+}
+
+// checks for the shape (\ {formals} {body})
+int lval_is_lambda_form(lval* v) {
+    if (v->count != 3) { return 0; }
+    if (v->cell[0]->type != LVAL_SYM || strcmp(v->cell[0]->sym, "\\") != 0) {
+        return 0;
+    }
+    if (v->cell[1]->type != LVAL_QEXPR || v->cell[2]->type != LVAL_QEXPR) {
+        return 0;
+    }
+    for (int i = 0; i < v->cell[1]->count; i++) {
+        if (v->cell[1]->cell[i]->type != LVAL_SYM) { return 0; }
+    }
+    return 1;
+}
+
+// closure conversion. a lambda captures the values of the variables its
+// body uses that are bound in local frames where it is made, into a
+// flat env of its own. globals are looked up at call time instead
+void lval_capture(lenv* closure, lenv* e, lval* formals, lval* v) {
+    switch (v->type) {
+        case LVAL_SYM:
+            if (formal_slot(formals, v->sym) != -1) { return; }
+            if (lenv_find(closure, v->sym) != -1) { return; }
+
+            for (; e && !e->global; e = e->par) {
+                int i = lenv_find(e, v->sym);
+                if (i != -1) {
+                    lenv_put(closure, v, e->vals[i]);
+                    return;
+                }
+            }
+        break;
+
+        case LVAL_QEXPR:
+        case LVAL_SEXPR:
+            for (int i = 0; i < v->count; i++) {
+                lval_capture(closure, e, formals, v->cell[i]);
+            }
+        break;
+    }
+}
+
+// lexical addressing. once a lambda's captures are known, every symbol
+// in its body naming a captured variable or a formal is tagged with its
+// slot in the call frame. frames are flat, so the depth is always 0.
+// lambdas written inside the body are left alone; they get resolved
+// against their own frame layout when they are made
+void lval_resolve(lval* v, lenv* captured, lval* formals) {
+    switch (v->type) {
+        case LVAL_SYM: {
+            int slot = lenv_find(captured, v->sym);
+            if (slot == -1) {
+                slot = formal_slot(formals, v->sym);
+                if (slot != -1) { slot += captured->count; }
+            }
+            if (slot != -1) {
+                v->depth = 0;
+                v->slot = slot;
+            }
+        }
+        break;
+
+        case LVAL_QEXPR:
+        case LVAL_SEXPR:
+            if (lval_is_lambda_form(v)) { return; }
+            for (int i = 0; i < v->count; i++) {
+                lval_resolve(v->cell[i], captured, formals);
+            }
+        break;
+    }
+}
+
+lval* lval_macro_at(lenv* e, lval* v);
+
+// whether a builtin's value depends only on its arguments, with nothing
+// else happening, so that a call on literals can be made ahead of time
+int builtin_pure(lbuiltin b) {
+    return b == builtin_add || b == builtin_sub || b == builtin_mul
+        || b == builtin_div || b == builtin_mod || b == builtin_pow
+        || b == builtin_lt || b == builtin_gt || b == builtin_lte
+        || b == builtin_gte || b == builtin_eq || b == builtin_ne
+        || b == builtin_head || b == builtin_tail || b == builtin_list
+        || b == builtin_join || b == builtin_len || b == builtin_init
+        || b == builtin_cons;
+}
+
+// whether x evaluates to itself
+int lval_literal(lval* x) {
+    return x->type == LVAL_LONG || x->type == LVAL_DOUBLE
+        || x->type == LVAL_STR || x->type == LVAL_QEXPR;
+}
+
+lval* lval_fold_list(lenv* e, lval* v, lval* formals, lval* guards);
+
+// whether the name x is bound locally where code is being folded: by
+// the formals, or in a frame of e, such as that of a lambda making
+// another one inside it. a local binding hides a constant's name
+int lval_fold_local(lenv* e, lval* x, lval* formals) {
+    if (formals && formal_slot(formals, x->sym) != -1) { return 1; }
+    for (; e && !e->global; e = e->par) {
+        if (lenv_find(e, x->sym) != -1) { return 1; }
+    }
+    return 0;
+}
+
+// the builtin that the name x means in code, if it's a global name for
+// one. a local binding could be changed with = while the code runs
+lbuiltin lval_fold_builtin(lenv* e, lval* x, lval* formals) {
+    if (x->type != LVAL_SYM || lval_fold_local(e, x, formals)) {
+        return NULL;
+    }
+
+    lval* f = lenv_peek(e, x);
+    return f && f->type == LVAL_FUN ? f->builtin : NULL;
+}
+
+// notes in guards that folding went by what the global name k means
+// now, as a pair of k and its value. guards is NULL for code that runs
+// straight after it's folded, when there's nothing to check later
+void lval_fold_guard(lenv* e, lval* k, lval* guards) {
+    if (!guards) { return; }
+    for (int i = 0; i < guards->count; i += 2) {
+        if (guards->cell[i]->sym == k->sym) { return; }
+    }
+    lval_add(guards, lval_copy(k));
+    lval_add(guards, lval_copy(lenv_peek(e, k)));
+}
+
+// constant folding. this is a pass over code before it's run: calls to
+// pure builtins on literals are replaced by their values, an if whose
+// condition is a literal by the branch it takes, and constants by their
+// values. formals are the names the code binds, which hide anything
+// global of the same name. the builtin names folding goes by are noted
+// in guards. it takes ownership of x, and returns it folded
+lval* lval_fold(lenv* e, lval* x, lval* formals, lval* guards) {
+    if (x->type == LVAL_SYM && consts) {
+        int i = lenv_find(consts, x->sym);
+        if (i != -1 && lval_literal(consts->vals[i])
+            && !lval_fold_local(e, x, formals)) {
+            lval_del(x);
+            return lval_copy(consts->vals[i]);
+        }
+    }
+
+    if (x->type != LVAL_SEXPR) { return x; }
+
+    // a part that folds down to a literal on its own is that literal
+    x = lval_fold_list(e, x, formals, guards);
+    if (x->count == 1 && lval_literal(x->cell[0])) { return lval_take(x, 0); }
+    return x;
+}
+
+// folds the code in the list v, which keeps its type: a lambda's body
+// is a q-expression
+lval* lval_fold_list(lenv* e, lval* v, lval* formals, lval* guards) {
+    if (v->count == 0 || lval_macro_at(e, v)) { return v; }
+
+    lbuiltin b = lval_fold_builtin(e, v->cell[0], formals);
+    int branches = b == builtin_if && v->count == 4
+        && v->cell[2]->type == LVAL_QEXPR && v->cell[3]->type == LVAL_QEXPR;
+
+    // only the parts change, so the list is only copied if one does
+    for (int i = 0; i < v->count; i++) {
+        lval* x = v->cell[i];
+        int branch = branches && i >= 2;
+        if (x->type != LVAL_SYM && x->type != LVAL_SEXPR && !branch) {
+            continue;
+        }
+
+        lval* y = lval_copy(x);
+        y = branch ? lval_fold_list(e, y, formals, guards)
+            : lval_fold(e, y, formals, guards);
+        if (y == x) {
+            lval_del(y);
+            continue;
+        }
+
+        v = lval_mut(v);
+        lval_del(v->cell[i]);
+        v->cell[i] = y;
+    }
+
+    // the branch an if takes, when that's already known, is code
+    if (branches && v->cell[1]->type == LVAL_LONG) {
+        lval* x = lval_mut(lval_copy(v->cell[v->cell[1]->num_long ? 2 : 3]));
+        x->type = v->type;
+        lval_fold_guard(e, v->cell[0], guards);
+        lval_del(v);
+        return x;
+    }
+
+    if (!b || v->count < 2) { return v; }
+    for (int i = 1; i < v->count; i++) {
+        if (!lval_literal(v->cell[i])) { return v; }
+    }
+
+    if (!builtin_pure(b)) { return v; }
+
+    lval* a = lval_sexpr();
+    for (int i = 1; i < v->count; i++) { lval_add(a, lval_copy(v->cell[i])); }
+
+    // errors are left to happen when the code runs, if it does
+    lval* r = b(e, a);
+    if (!lval_literal(r)) {
+        lval_del(r);
+        return v;
+    }
+
+    lval* x = v->type == LVAL_QEXPR ? lval_qexpr() : lval_sexpr();
+    lval_fold_guard(e, v->cell[0], guards);
+    lval_del(v);
+    return lval_add(x, r);
+}
+
+lcode* lcode_new(void);
+int lcode_const(lcode* c, lval* v);
+
+// makes a lambda closing over e, taking ownership of formals and body.
+// the body gets folded first. if that went by what some builtin names
+// mean now, the body as written is kept on the folded one's code, with
+// those names and their values, and runs in its place whenever one of
+// them has been rebound (see lval_body)
+lval* lval_make_lambda(lenv* e, lval* formals, lval* body) {
+    lval* err = lval_const_check(formals);
+    if (err) {
+        lval_del(formals);
+        lval_del(body);
+        return err;
+    }
+
+    lval* guards = lval_qexpr();
+    lval* folded = lval_fold_list(e, lval_copy(body), formals, guards);
+    lval* f = lval_lambda(formals, folded);
+
+    if (guards->count) {
+        // folding only ever drops code, so what the written body
+        // captures covers the folded one too
+        lcode* c = lcode_new();
+        c->fold_body = lcode_const(c, lval_copy(body));
+        c->fold_guards = c->nconsts;
+        for (int i = 0; i < guards->count; i++) {
+            lcode_const(c, lval_copy(guards->cell[i]));
+        }
+        c->fold_nguards = guards->count / 2;
+        c->fold_version = lenv_version;
+        c->fold_ok = 1;
+        folded->code = c;
+
+        lval_capture(f->env, e, formals, body);
+        lval_resolve(body, f->env, formals);
+    } else {
+        lval_capture(f->env, e, formals, folded);
+    }
+    lval_resolve(folded, f->env, formals);
+
+    lval_del(guards);
+    lval_del(body);
+    return f;
+}
+
 lval* builtin_lambda(lenv* e, lval* a) {
     LASSERT_NUM("\\", a, 2);
     LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
@@ -962,7 +2223,52 @@ lval* builtin_lambda(lenv* e, lval* a) {
     lval* body = lval_pop(a, 0);
     lval_del(a);
 
-    return lval_lambda(formals, body);
+    return lval_make_lambda(e, formals, body);
+}
+
+// set once any macro has been defined. until then, evaluation doesn't
+// need to look for macro calls
+int macros_defined = 0;
+
+// (defmacro {name formals...} {body}) defines a macro. when called, it
+// gets the parts of the call unevaluated, and what it returns is
+// evaluated in place of the call
+lval* builtin_defmacro(lenv* e, lval* a) {
+    LASSERT_NUM("defmacro", a, 2);
+    LASSERT_TYPE("defmacro", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("defmacro", a, 1, LVAL_QEXPR);
+    LASSERT(a, a->cell[0]->count > 0,
+        "Function 'defmacro' needs a name for the macro!");
+
+    for (int i = 0; i < a->cell[0]->count; i++) {
+        LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
+        "Can't define a non-symbol. You gave a %s, but I expected a %s.",
+        ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+    }
+
+    lval* err = lval_const_check(a->cell[0]);
+    if (err) {
+        lval_del(a);
+        return err;
+    }
+
+    lval* formals = lval_mut(lval_pop(a, 0));
+    lval* name = lval_pop(formals, 0);
+    lval* body = lval_pop(a, 0);
+    lval_del(a);
+
+    lval* m = lval_make_lambda(e, formals, body);
+    if (m->type == LVAL_ERR) {
+        lval_del(name);
+        return m;
+    }
+    m->type = LVAL_MACRO;
+    lenv_def(e, name, m);
+    lval_del(name);
+    lval_del(m);
+
+    macros_defined = 1;
+    return lval_sexpr();
 }
 
 lval* builtin_load(lenv* e, lval* a) {
@@ -979,7 +2285,7 @@ lval* builtin_load(lenv* e, lval* a) {
 
         // evaluate all expressions
         while (expr->count) {
-            lval* x = lval_eval(e, lval_pop(expr, 0));
+            lval* x = lval_eval(e, lval_fold(e, lval_pop(expr, 0), NULL, NULL));
 
             // if evaluation produces error, print it
             if (x->type == LVAL_ERR) { lval_println(x); }
@@ -1018,164 +2324,2835 @@ lval* builtin_print(lenv* e, lval* a) {
     return lval_sexpr();
 }
 
-lval* lval_call(lenv* e, lval* f, lval* a) {
-
-    // if builtin, call the builtin
-    if (f->builtin) { return f->builtin(e, a); }
-
-    int given = a->count;
-    int total = f->formals->count;
+// binds the n values in xs, which it takes, to the formals of the
+// lambda f. every call
+// gets a frame starting from the function's captured variables and any
+// arguments bound by partial application; f itself is never changed.
+// if frame_out holds a frame left by a call to this same function, it
+// is reused, since binding just overwrites the formals. if all the
+// formals got bound, returns NULL and hands the frame back through
+// frame_out. otherwise returns the partially applied function, or an
+// error
+lval* lval_bind_args(lenv* e, lval* f, int n, lval** xs, lenv** frame_out) {
+    lenv* frame = *frame_out ? *frame_out : lenv_copy(f->env);
+    lval* formals = f->formals;
+
+    int total = formals->count;
+    int i = 0;
 
-    while(a->count) {
+    for (int j = 0; j < n; j++) {
         // if no more formal arguments to bind
-        if (f->formals->count == 0) {
-            lval_del(a); return lval_err(
+        if (i == total) {
+            while (j < n) { lval_del(xs[j++]); }
+            lenv_del(frame);
+            return lval_err(
                 "You gave the function too many arguments! "
-                "Got %i, wanted %i.", given, total);
+                "Got %i, wanted %i.", n, total);
         }
 
-        lval* sym = lval_pop(f->formals, 0);
+        lval* sym = formals->cell[i++];
 
-        if (strcmp(sym->sym, "&") == 0) {
-            if (f->formals->count != 1) {
-                lval_del(a);
+        if (sym->sym == sym_amp()) {
+            if (i != total - 1) {
+                while (j < n) { lval_del(xs[j++]); }
+                lenv_del(frame);
                 return lval_err("Format invalid. "
                 "Symbol '&' not followed by a single symbol.");
             }
 
-            lval* nsym = lval_pop(f->formals, 0);
-            lenv_put(f->env, nsym, builtin_list(e, a));
-            lval_del(sym); lval_del(nsym);
+            // the rest of the values go in a list
+            lval* rest = lval_qexpr();
+            rest->count = n - j;
+            rest->cell = malloc(sizeof(lval*) * rest->count);
+            memcpy(rest->cell, xs + j, sizeof(lval*) * rest->count);
+            lenv_put(frame, formals->cell[i++], rest);
+            lval_del(rest);
             break;
         }
 
-        lval* val = lval_pop(a, 0);
+        lenv_put(frame, sym, xs[j]);
+        lval_del(xs[j]);
+    }
+
+    // if & remains in list, bind to empty list
+    if (i < total && formals->cell[i]->sym == sym_amp()) {
+        if (i != total - 2) {
+            lenv_del(frame);
+            return lval_err("Function format invalid. "
+            "Symbol '&' not followed by single symbol.");
+        }
+
+        lval* val = lval_qexpr();
+        lenv_put(frame, formals->cell[i+1], val);
+        lval_del(val);
+        i += 2;
+    }
+
+    // if all formals bound, the frame is ready. scope is lexical, so
+    // its parent is the global env rather than the caller
+    if (i == total) {
+        while (e->par) { e = e->par; }
+        frame->par = e;
+        *frame_out = frame;
+        return NULL;
+    }
 
-        lenv_put(f->env, sym, val);
-        lval_del(sym); lval_del(val);
+    // otherwise, return partially evaluated function, holding the
+    // bound arguments and taking the formals that are left
+    lval* rest = lval_qexpr();
+    while (i < total) {
+        lval_add(rest, lval_copy(formals->cell[i++]));
     }
 
-    // now argument list is all bound, delete it
+    lval* p = lval_lambda(rest, lval_copy(f->body));
+    lenv_del(p->env);
+    p->env = frame;
+    return p;
+}
+
+// the same, for the values in the argument list a, which it takes
+lval* lval_bind(lenv* e, lval* f, lval* a, lenv** frame_out) {
+    int n = a->count;
+    a->count = 0;
+    lval* r = lval_bind_args(e, f, n, a->cell, frame_out);
     lval_del(a);
+    return r;
+}
 
-    // if & remains in list, bind to empty list
-    if (f->formals->count > 0 &&
-        strcmp(f->formals->cell[0]->sym, "&") == 0) {
-            if (f->formals->count != 2) {
-                return lval_err("Function format invalid. "
-                "Symbol '&' not followed by single symbol.");
-            }
+lval* vm_run(lenv* frame, lval* f, lval** fn);
+lval* lval_eval_code(lenv* e, lval* v, lval** fn);
 
-            lval_del(lval_pop(f->formals, 0));
+// whether the lambda f has a body compiled to bytecode
+int lval_compiled(lval* f) {
+    return f->body->code && f->body->code->count;
+}
 
-            lval* sym = lval_pop(f->formals, 0);
-            lval* val = lval_qexpr();
+// the body to run for the lambda f. a body folded using what some
+// builtin names meant when f was made (see lval_make_lambda) is only
+// good while they still mean that. otherwise it's the body as written,
+// which looks them up as it goes. e is any env, for finding the
+// global one
+lval* lval_body(lenv* e, lval* f) {
+    lcode* c = f->body->code;
+    if (!c || !c->fold_nguards) { return f->body; }
+
+    // the names only need checking again after something global has
+    // changed
+    if (c->fold_version != lenv_version) {
+        while (e->par) { e = e->par; }
+
+        c->fold_ok = 1;
+        for (int i = 0; i < c->fold_nguards; i++) {
+            lval* x = lenv_peek(e, c->consts[c->fold_guards + 2*i]);
+            lval* expect = c->consts[c->fold_guards + 2*i + 1];
+            if (x != expect && !(x && x->type == LVAL_FUN
+                    && x->builtin == expect->builtin)) {
+                c->fold_ok = 0;
+            }
+        }
+        c->fold_version = lenv_version;
+    }
+    return c->fold_ok ? f->body : c->consts[c->fold_body];
+}
 
-            lenv_put(f->env, sym, val);
-            lval_del(sym); lval_del(val);
+// runs the body of the lambda f in frame, taking ownership of the
+// frame. a call to a lambda in tail position comes back here instead
+// of recursing, so tail recursion runs in constant C stack, and a
+// function calling itself keeps using the same frame. with the stack
+// evaluator on, the body runs there instead, so that a call made by a
+// builtin doesn't recurse on the C stack either
+lval* lval_run(lenv* frame, lval* f) {
+    if (eval_limit) { return lval_eval_stack(frame, NULL, lval_copy(f)); }
+
+    lenv* root = frame->par;
+
+    f = lval_copy(f);
+    for (;;) {
+        lval* next = NULL;
+        lval* r;
+        lval* body = lval_body(root, f);
+
+        if (body == f->body && lval_compiled(f)) {
+            // compiled bodies run on the vm, which owns the frame
+            r = vm_run(frame, f, &next);
+            frame = NULL;
+        } else {
+            r = lval_eval_code(frame, body, &next);
         }
 
-    // if all formals bound, evaluate
-    if (f->formals->count == 0) {
+        if (!next) {
+            if (frame) { lenv_del(frame); }
+            lval_del(f);
+            return r;
+        }
 
-        f->env->par = e;
+        // r holds the arguments for the call to next
+        lenv* nf = next == f ? frame : NULL;
+        lval* err = lval_bind(root, next, r, &nf);
+        if (frame && next != f) { lenv_del(frame); }
+        lval_del(f);
+        f = next;
 
-        return builtin_eval(
-            f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
-    } else {
-        // otherwise, return partially evaluated function
-        return lval_copy(f);
+        if (err) {
+            lval_del(f);
+            return err;
+        }
+        frame = nf;
     }
 }
 
-void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
-    lval* k = lval_sym(name);
-    lval* v = lval_fun(func);
-    lenv_put(e, k, v);
-    lval_del(k); lval_del(v);
+// how many calls make a lambda hot enough for the jit to look at
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 1000
+#endif
+
+void jit_lambda(lenv* e, lval* f);
+lval* jit_call(lenv* e, lval* f, int n, lval** xs);
+
+// counts a call to the lambda f for the jit, and if f has native code
+// that can take the n values in xs, runs it on them, taking them.
+// otherwise returns NULL, leaving them alone
+lval* lval_call_native(lenv* e, lval* f, int n, lval** xs) {
+#ifdef TEDDY_JIT
+    // a lambda that gets called a lot is worth a look from the jit
+    if (f->body->calls >= 0 && ++f->body->calls == JIT_THRESHOLD) {
+        jit_lambda(e, f);
+    }
+    if (f->body->code && f->body->code->native && !eval_limit
+        && lval_body(e, f) == f->body) {
+        return jit_call(e, f, n, xs);
+    }
+#endif
+    return NULL;
 }
 
-void lenv_add_builtins(lenv* e) {
-    // list functions
-    lenv_add_builtin(e, "head", builtin_head);
-    lenv_add_builtin(e, "tail", builtin_tail);
-    lenv_add_builtin(e, "list", builtin_list);
-    lenv_add_builtin(e, "eval", builtin_eval);
-    lenv_add_builtin(e, "join", builtin_join);
+lval* lval_call(lenv* e, lval* f, lval* a) {
+
+    // if builtin, call the builtin
+    if (f->builtin) { return f->builtin(e, a); }
+
+    lval* r = lval_call_native(e, f, a->count, a->cell);
+    if (r) {
+        a->count = 0;
+        lval_del(a);
+        return r;
+    }
+
+    lenv* frame = NULL;
+    r = lval_bind(e, f, a, &frame);
+    if (r) { return r; }
+
+    return lval_run(frame, f);
+}
+
+// calls the lambda f with the n values in xs, which it takes. they're
+// bound straight into the frame, with no argument list made for them
+lval* lval_call_args(lenv* e, lval* f, int n, lval** xs) {
+    lval* r = lval_call_native(e, f, n, xs);
+    if (r) { return r; }
+
+    lenv* frame = NULL;
+    r = lval_bind_args(e, f, n, xs, &frame);
+    if (r) { return r; }
+
+    return lval_run(frame, f);
+}
+
+// the macro that the s-expression v is a call to, if any. like a
+// function, a macro on its own in an s-expression is just its value
+lval* lval_macro_at(lenv* e, lval* v) {
+    if (!macros_defined || v->count < 2 || v->cell[0]->type != LVAL_SYM) {
+        return NULL;
+    }
+
+    lval* x = lenv_peek(e, v->cell[0]);
+    return x && x->type == LVAL_MACRO ? x : NULL;
+}
+
+// expands v, a call to the macro m: the macro's body runs with the
+// parts of v, unevaluated, bound to its formals, and a q-expression it
+// gives back is taken as code. the expansion is cached on v for as
+// long as its name still means m, so each call site in a function
+// body is only expanded once
+lval* lval_expand(lenv* e, lval* m, lval* v) {
+    if (v->expansion && v->expansion->cell[0] == m) {
+        return lval_copy(v->expansion->cell[1]);
+    }
+
+    lval* a = lval_sexpr();
+    for (int i = 1; i < v->count; i++) {
+        lval_add(a, lval_copy(v->cell[i]));
+    }
+
+    lenv* frame = NULL;
+    lval* x = lval_bind(e, m, a, &frame);
+    if (x) {
+        if (x->type == LVAL_ERR) { return x; }
+        lval_del(x);
+        return lval_err("Macro '%s' was given too few arguments!",
+            v->cell[0]->sym);
+    }
+
+    x = lval_run(frame, m);
+    if (x->type == LVAL_ERR) { return x; }
+    if (x->type == LVAL_QEXPR) {
+        x = lval_mut(x);
+        x->type = LVAL_SEXPR;
+    }
+
+    lval* cache = lval_qexpr();
+    lval_add(cache, lval_copy(m));
+    lval_add(cache, lval_copy(x));
+    if (v->expansion) { lval_del(v->expansion); }
+    v->expansion = cache;
+    return x;
+}
+
+// bytecode compiler and vm. a function body compiles to code for a
+// small stack machine: operands are pushed, calls pop the function and
+// its arguments and push the result. symbol lookups go through the
+// same resolved slots and inline caches as the tree walker, so code
+// doesn't depend on frame layout, and a (compile f) stays valid when
+// globals change. if forms become jumps, guarded by a check that 'if'
+// still means the builtin
+enum {
+    OP_CONST,        // k          push consts[k]
+    OP_LOAD,         // k          push the value of the symbol consts[k]
+    OP_CALL,         // n          call the function under n arguments
+    OP_TAILCALL,     // n          same, reusing this frame
+    OP_CALLSYM,      // k n        call the function named consts[k]
+    OP_TAILCALLSYM,  // k n        same, reusing this frame
+    OP_GUARD,        // k f x t    unless consts[k] is the builtin in
+                     //            consts[f], eval consts[x] and go to t
+    OP_JUMPF,        // t end      pop a condition, go to t if false
+    OP_JUMP,         // t          go to t
+    OP_RETURN,       //            pop the result and return it
+    OP_INLINE,       // k n c t    unless the names in consts[k] are still
+                     //            bound as they were, go to c. otherwise
+                     //            run the inlined body on the n arguments,
+                     //            or make the first error the value and go
+                     //            to t
+    OP_ARG,          // i          push the value in stack slot i
+    OP_DROP,         // n          drop the n values under the top one
+    OP_GLOBAL        // k          push the global value of consts[k]
+};
+
+char* op_names[] = { "CONST", "LOAD", "CALL", "TAILCALL", "CALLSYM",
+    "TAILCALLSYM", "GUARD", "JUMPF", "JUMP", "RETURN", "INLINE", "ARG",
+    "DROP", "GLOBAL" };
+int op_operands[] = { 1, 1, 1, 1, 2, 2, 4, 2, 1, 0, 4, 1, 1, 1 };
+
+lcode* lcode_new(void) {
+    lcode* c = malloc(sizeof(lcode));
+    c->ops = NULL;
+    c->count = 0;
+    c->cap = 0;
+    c->consts = NULL;
+    c->nconsts = 0;
+    c->depth = 0;
+    c->max_depth = 0;
+    c->native = NULL;
+    c->native_size = 0;
+    c->native_args = 0;
+    c->native_formals = 0;
+    c->native_guards = 0;
+    c->native_nguards = 0;
+    c->native_version = 0;
+    c->native_ok = 0;
+    c->fold_body = 0;
+    c->fold_guards = 0;
+    c->fold_nguards = 0;
+    c->fold_version = 0;
+    c->fold_ok = 0;
+    return c;
+}
+
+// appends an op or operand, returning where it went
+int lcode_emit(lcode* c, int x) {
+    if (c->count == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 16;
+        c->ops = realloc(c->ops, sizeof(int) * c->cap);
+    }
+    c->ops[c->count] = x;
+    return c->count++;
+}
+
+// adds v to the constants, taking ownership of it
+int lcode_const(lcode* c, lval* v) {
+    c->nconsts++;
+    c->consts = realloc(c->consts, sizeof(lval*) * c->nconsts);
+    c->consts[c->nconsts-1] = v;
+    return c->nconsts-1;
+}
+
+// tracks how deep the value stack gets
+void lcode_stack(lcode* c, int n) {
+    c->depth += n;
+    if (c->depth > c->max_depth) { c->max_depth = c->depth; }
+}
+
+void compile_list(lcode* c, lenv* e, lval* v, int tail);
+
+// inlining. a call to a small lambda bound to a global name, whose body
+// only calls builtins that work on their arguments, gets the body
+// compiled in place of the call. its arguments stay on the stack, where
+// the body reads them instead of from a frame. the body runs in the
+// caller's frame, but scope is lexical, so its other names have to
+// mean what they would in the lambda's own frame. it captures nothing,
+// so they are globals, and are loaded with OP_GLOBAL. the names of the
+// builtins it calls are checked after the arguments are evaluated, in
+// the caller's frame where the calls will look them up, and if one
+// isn't bound as it was, the call is made as usual. eval is never
+// inlined, since what it evaluates would see the caller's frame
+#ifndef INLINE_MAX
+#define INLINE_MAX 16
+#endif
+
+// while a body is being inlined, its formals and the stack slot of the
+// first argument
+lval* inline_formals = NULL;
+int inline_base = 0;
+
+int compile_formal(lval* formals, lval* x) {
+    for (int i = 0; formals && i < formals->count; i++) {
+        if (formals->cell[i]->sym == x->sym) { return i; }
+    }
+    return -1;
+}
+
+// whether the builtin b can be called from an inlined body
+int inline_builtin(lbuiltin b) {
+    return builtin_pure(b) || b == builtin_print || b == builtin_error;
+}
+
+int compile_is_if(lenv* e, lval* v);
+
+// checks that x, part of the body of the lambda f, can be inlined,
+// counting its size. code is 0 inside a q-expression that's data, which
+// can't mention the formals. the names it depends on go in guards
+int inline_check(lenv* e, lval* f, lval* x, int code, int* size,
+    lval* guards) {
+    if (++*size > INLINE_MAX) { return 0; }
+
+    if (x->type == LVAL_SYM) {
+        return code || compile_formal(f->formals, x) == -1;
+    }
+    if (x->type != LVAL_SEXPR && x->type != LVAL_QEXPR) { return 1; }
+
+    if (!code) {
+        for (int i = 0; i < x->count; i++) {
+            if (!inline_check(e, f, x->cell[i], 0, size, guards)) { return 0; }
+        }
+        return 1;
+    }
+
+    if (x->count < 2) {
+        return x->count == 0 || inline_check(e, f, x->cell[0], 1, size, guards);
+    }
+
+    // a call, which has to be to a builtin through a name
+    lval* h = x->cell[0];
+    if (h->type != LVAL_SYM || compile_formal(f->formals, h) != -1) {
+        return 0;
+    }
+    lval* b = lenv_peek(e, h);
+    if (!b || b->type != LVAL_FUN) { return 0; }
+
+    int branches = compile_is_if(e, x);
+    if (!branches && !inline_builtin(b->builtin)) { return 0; }
+
+    // the calls in inlined code look up their names in the caller's
+    // frame, and an if gets no guard of its own there, so all of them
+    // are checked on the way in
+    if (compile_formal(guards, h) == -1) {
+        lval_add(guards, lval_copy(h));
+        lval_add(guards, lval_copy(b));
+    }
+
+    for (int i = 1; i < x->count; i++) {
+        int part = x->cell[i]->type != LVAL_QEXPR || (branches && i >= 2);
+        if (!inline_check(e, f, x->cell[i], part, size, guards)) { return 0; }
+    }
+    return 1;
+}
+
+// the names a call to f with n arguments through the name k depends
+// on, paired with their values, if it can be inlined. otherwise NULL
+lval* inline_guards(lenv* e, lval* k, lval* f, int n) {
+    if (inline_formals || f->builtin || f->env->count
+        || f->formals->count != n) {
+        return NULL;
+    }
+    for (int i = 0; i < n; i++) {
+        if (f->formals->cell[i]->sym == sym_amp()) { return NULL; }
+    }
+
+    lval* guards = lval_qexpr();
+    lval_add(guards, lval_copy(k));
+    lval_add(guards, lval_copy(f));
+
+    int size = 0;
+    if (!inline_check(e, f, f->body, 1, &size, guards)) {
+        lval_del(guards);
+        return NULL;
+    }
+
+    // the body may have been folded using builtin names, which then
+    // have to keep their meaning too
+    lcode* c = f->body->code;
+    for (int i = 0; c && i < 2 * c->fold_nguards; i++) {
+        lval_add(guards, lval_copy(c->consts[c->fold_guards + i]));
+    }
+    return guards;
+}
+
+void compile_expr(lcode* c, lenv* e, lval* v, int tail) {
+    int arg = v->type == LVAL_SYM ? compile_formal(inline_formals, v) : -1;
+    if (arg != -1) {
+        lcode_emit(c, OP_ARG);
+        lcode_emit(c, inline_base + arg);
+        lcode_stack(c, 1);
+        return;
+    }
+
+    switch (v->type) {
+        case LVAL_SYM:
+            lcode_emit(c, inline_formals ? OP_GLOBAL : OP_LOAD);
+            lcode_emit(c, lcode_const(c, lval_copy(v)));
+            lcode_stack(c, 1);
+        break;
+
+        case LVAL_SEXPR: compile_list(c, e, v, tail); break;
+
+        default:
+            lcode_emit(c, OP_CONST);
+            lcode_emit(c, lcode_const(c, lval_copy(v)));
+            lcode_stack(c, 1);
+        break;
+    }
+}
+
+// checks for (if cond {then} {else}) where 'if' is the global builtin
+int compile_is_if(lenv* e, lval* v) {
+    if (v->count != 4 || v->cell[0]->type != LVAL_SYM) { return 0; }
+    if (v->cell[2]->type != LVAL_QEXPR || v->cell[3]->type != LVAL_QEXPR) {
+        return 0;
+    }
+    if (v->cell[0]->depth >= 0) { return 0; }
+
+    lval* f = lenv_peek(e, v->cell[0]);
+    return f && f->type == LVAL_FUN && f->builtin == builtin_if;
+}
+
+// compiles the cells of v as an s-expression: nothing, a single value,
+// or a call. tail says whether its value is what the function returns
+void compile_list(lcode* c, lenv* e, lval* v, int tail) {
+
+    // macro calls are expanded now, and the expansion compiled instead.
+    // a name bound in the function's own frames can't be a macro
+    int local = v->count > 1 && v->cell[0]->type == LVAL_SYM
+        && v->cell[0]->depth >= 0;
+    lval* m = local ? NULL : lval_macro_at(e, v);
+    if (m) {
+        lval* x = lval_expand(e, m, v);
+        if (x->type == LVAL_SEXPR) {
+            compile_list(c, e, x, tail);
+        } else {
+            compile_expr(c, e, x, tail);
+        }
+        lval_del(x);
+        return;
+    }
+
+    if (v->count == 0) {
+        lcode_emit(c, OP_CONST);
+        lcode_emit(c, lcode_const(c, lval_sexpr()));
+        lcode_stack(c, 1);
+        return;
+    }
+
+    if (v->count == 1) {
+        compile_expr(c, e, v->cell[0], tail);
+        return;
+    }
+
+    if (compile_is_if(e, v)) {
+        // if the guard fails the form is evaluated as written. inlined
+        // code has been checked already
+        int guard_end = -1;
+        if (!inline_formals) {
+            lval* form = lval_dup(v);
+            form->type = LVAL_SEXPR;
+
+            lcode_emit(c, OP_GUARD);
+            lcode_emit(c, lcode_const(c, lval_copy(v->cell[0])));
+            lcode_emit(c, lcode_const(c, lval_copy(lenv_peek(e, v->cell[0]))));
+            lcode_emit(c, lcode_const(c, form));
+            guard_end = lcode_emit(c, 0);
+        }
+
+        compile_expr(c, e, v->cell[1], 0);
+        lcode_emit(c, OP_JUMPF);
+        int jump_else = lcode_emit(c, 0);
+        int jumpf_end = lcode_emit(c, 0);
+        lcode_stack(c, -1);
+
+        compile_list(c, e, v->cell[2], tail);
+        lcode_emit(c, OP_JUMP);
+        int then_end = lcode_emit(c, 0);
+        lcode_stack(c, -1);
+
+        c->ops[jump_else] = c->count;
+        compile_list(c, e, v->cell[3], tail);
+
+        if (guard_end != -1) { c->ops[guard_end] = c->count; }
+        c->ops[jumpf_end] = c->count;
+        c->ops[then_end] = c->count;
+        return;
+    }
+
+    // calls through a name evaluate the arguments before the name
+    int n = v->count - 1;
+    if (v->cell[0]->type == LVAL_SYM) {
+        for (int i = 1; i < v->count; i++) {
+            compile_expr(c, e, v->cell[i], 0);
+        }
+
+        lval* f = local ? NULL : lenv_peek(e, v->cell[0]);
+        lval* guards = f && f->type == LVAL_FUN
+            ? inline_guards(e, v->cell[0], f, n) : NULL;
+        if (guards) {
+            lcode_emit(c, OP_INLINE);
+            lcode_emit(c, lcode_const(c, guards));
+            lcode_emit(c, n);
+            int call = lcode_emit(c, 0);
+            int error_end = lcode_emit(c, 0);
+
+            inline_formals = f->formals;
+            inline_base = c->depth - n;
+            compile_list(c, e, f->body, 0);
+            inline_formals = NULL;
+
+            lcode_emit(c, OP_DROP);
+            lcode_emit(c, n);
+            lcode_stack(c, -n);
+            lcode_emit(c, OP_JUMP);
+            int inline_end = lcode_emit(c, 0);
+
+            // the call as usual, with the arguments still on the stack
+            c->ops[call] = c->count;
+            c->depth += n - 1;
+            lcode_emit(c, tail ? OP_TAILCALLSYM : OP_CALLSYM);
+            lcode_emit(c, lcode_const(c, lval_copy(v->cell[0])));
+            lcode_emit(c, n);
+            lcode_stack(c, 1 - n);
+
+            c->ops[error_end] = c->count;
+            c->ops[inline_end] = c->count;
+            return;
+        }
+
+        lcode_emit(c, tail ? OP_TAILCALLSYM : OP_CALLSYM);
+        lcode_emit(c, lcode_const(c, lval_copy(v->cell[0])));
+        lcode_emit(c, n);
+        lcode_stack(c, 1 - n);
+        return;
+    }
+
+    for (int i = 0; i < v->count; i++) {
+        compile_expr(c, e, v->cell[i], 0);
+    }
+    lcode_emit(c, tail ? OP_TAILCALL : OP_CALL);
+    lcode_emit(c, n);
+    lcode_stack(c, -n);
+}
+
+// compiles the body of the lambda f, unless that's already been done
+void compile_lambda(lenv* e, lval* f) {
+    if (lval_compiled(f)) { return; }
+
+    lcode* c = f->body->code ? f->body->code : lcode_new();
+    compile_list(c, e, f->body, 1);
+    lcode_emit(c, OP_RETURN);
+    f->body->code = c;
+}
+
+// the vm's value stack, shared by nested runs. it can move when it
+// grows, so it is only ever indexed
+lval** vm_stack = NULL;
+int vm_sp = 0;
+int vm_cap = 0;
+
+void vm_reserve(int n) {
+    if (vm_sp + n <= vm_cap) { return; }
+    while (vm_sp + n > vm_cap) { vm_cap = vm_cap ? vm_cap * 2 : 256; }
+    vm_stack = realloc(vm_stack, sizeof(lval*) * vm_cap);
+}
+
+// pops n values into a new argument list
+lval* vm_args(int n) {
+    lval* a = lval_sexpr();
+    a->count = n;
+    a->cell = malloc(sizeof(lval*) * n);
+    vm_sp -= n;
+    memcpy(a->cell, &vm_stack[vm_sp], sizeof(lval*) * n);
+    return a;
+}
+
+// the first error among a call's arguments, taken out of a, or NULL
+lval* lval_args_error(lval* a) {
+    for (int i = 0; i < a->count; i++) {
+        if (a->cell[i]->type == LVAL_ERR) { return lval_pop(a, i); }
+    }
+    return NULL;
+}
+
+lval* lval_not_function(lval* f) {
+    return lval_err(
+        "S-Expression started with incorrect type. "
+        "Got %s, wanted a %s.",
+        ltype_name(f->type), ltype_name(LVAL_FUN));
+}
+
+// calls f, which stays the caller's, with the n values in xs, which
+// the call takes. a lambda gets them bound straight into its frame. a
+// builtin still needs them in an argument list
+lval* lval_apply(lenv* e, lval* f, int n, lval** xs) {
+    if (!f->builtin) { return lval_call_args(e, f, n, xs); }
+
+    lval* a = lval_sexpr();
+    a->count = n;
+    a->cell = malloc(sizeof(lval*) * n);
+    memcpy(a->cell, xs, sizeof(lval*) * n);
+    return f->builtin(e, a);
+}
+
+// map, filter and foldl go along the cells of the list once, where
+// written in teddy on head and tail they would copy what's left of
+// the list at every step. results are allocated at their full size
+lval* builtin_map(lenv* e, lval* a) {
+    LASSERT_NUM("map", a, 2);
+    LASSERT_TYPE("map", a, 0, LVAL_FUN);
+    LASSERT_TYPE("map", a, 1, LVAL_QEXPR);
+
+    lval* f = a->cell[0];
+    lval* l = a->cell[1];
+    lval* r = lval_qexpr();
+    r->cell = malloc(sizeof(lval*) * l->count);
+
+    for (int i = 0; i < l->count; i++) {
+        lval* x = lval_copy(l->cell[i]);
+        lval* y = lval_apply(e, f, 1, &x);
+        if (y->type == LVAL_ERR) {
+            lval_del(r);
+            lval_del(a);
+            return y;
+        }
+        r->cell[r->count++] = y;
+    }
+
+    lval_del(a);
+    return r;
+}
+
+lval* builtin_filter(lenv* e, lval* a) {
+    LASSERT_NUM("filter", a, 2);
+    LASSERT_TYPE("filter", a, 0, LVAL_FUN);
+    LASSERT_TYPE("filter", a, 1, LVAL_QEXPR);
+
+    lval* f = a->cell[0];
+    lval* l = a->cell[1];
+    lval* r = lval_qexpr();
+    r->cell = malloc(sizeof(lval*) * l->count);
+
+    for (int i = 0; i < l->count; i++) {
+        lval* x = lval_copy(l->cell[i]);
+        lval* y = lval_apply(e, f, 1, &x);
+        if (y->type != LVAL_LONG) {
+            lval* err = y->type == LVAL_ERR ? lval_copy(y) : lval_err(
+                "Function 'filter' needs a function that gives back a %s. "
+                "Got %s.", ltype_name(LVAL_LONG), ltype_name(y->type));
+            lval_del(y);
+            lval_del(r);
+            lval_del(a);
+            return err;
+        }
+        if (y->num_long) { r->cell[r->count++] = lval_copy(l->cell[i]); }
+        lval_del(y);
+    }
+
+    lval_del(a);
+    return r;
+}
+
+lval* builtin_foldl(lenv* e, lval* a) {
+    LASSERT_NUM("foldl", a, 3);
+    LASSERT_TYPE("foldl", a, 0, LVAL_FUN);
+    LASSERT_TYPE("foldl", a, 2, LVAL_QEXPR);
+
+    lval* f = a->cell[0];
+    lval* l = a->cell[2];
+    lval* z = lval_copy(a->cell[1]);
+
+    for (int i = 0; i < l->count && z->type != LVAL_ERR; i++) {
+        lval* xs[] = { z, lval_copy(l->cell[i]) };
+        z = lval_apply(e, f, 2, xs);
+    }
+
+    lval_del(a);
+    return z;
+}
+
+lval* builtin_reverse(lenv* e, lval* a) {
+    LASSERT_NUM("reverse", a, 1);
+    LASSERT_TYPE("reverse", a, 0, LVAL_QEXPR);
+
+    // turned round in place when nothing else holds the list
+    lval* l = lval_mut(lval_pop(a, 0));
+    lval_del(a);
+
+    for (int i = 0, j = l->count - 1; i < j; i++, j--) {
+        lval* x = l->cell[i];
+        l->cell[i] = l->cell[j];
+        l->cell[j] = x;
+    }
+    return l;
+}
+
+lval* builtin_nth(lenv* e, lval* a) {
+    LASSERT_NUM("nth", a, 2);
+    LASSERT_TYPE("nth", a, 0, LVAL_LONG);
+    LASSERT_TYPE("nth", a, 1, LVAL_QEXPR);
+
+    long n = a->cell[0]->num_long;
+    int count = a->cell[1]->count;
+    LASSERT(a, n >= 0 && n < count,
+        "Function 'nth' passed index %li, but the list has %i items.",
+        n, count);
+
+    lval* x = lval_copy(a->cell[1]->cell[n]);
+    lval_del(a);
+    return x;
+}
+
+#ifdef __GNUC__
+#define VM_COMPUTED_GOTO
+#endif
+
+#ifdef VM_COMPUTED_GOTO
+#define VM_CASE(op) L_##op:
+#define VM_NEXT goto *vm_labels[ops[pc++]]
+#else
+#define VM_CASE(op) case op:
+#define VM_NEXT continue
+#endif
+
+// runs the compiled body of f in frame, taking ownership of the frame.
+// calls in tail position to compiled lambdas replace the frame and
+// carry on in the same loop. for other lambdas, the arguments are
+// returned and the function handed back through fn, for lval_run
+lval* vm_run(lenv* frame, lval* f, lval** fn_out) {
+#ifdef VM_COMPUTED_GOTO
+    static void* vm_labels[] = { &&L_OP_CONST, &&L_OP_LOAD, &&L_OP_CALL,
+        &&L_OP_TAILCALL, &&L_OP_CALLSYM, &&L_OP_TAILCALLSYM, &&L_OP_GUARD,
+        &&L_OP_JUMPF, &&L_OP_JUMP, &&L_OP_RETURN, &&L_OP_INLINE, &&L_OP_ARG,
+        &&L_OP_DROP, &&L_OP_GLOBAL };
+#endif
+
+    // hold on to f, and with it the code, while it runs
+    f = lval_copy(f);
+    lcode* code = f->body->code;
+    int* ops = code->ops;
+    int pc = 0;
+    vm_reserve(code->max_depth);
+
+    // where this run's part of the stack starts
+    int base = vm_sp;
+
+    lval* result;
+    lval* fn;
+    lval* a;
+    int tail;
+
+#ifdef VM_COMPUTED_GOTO
+    VM_NEXT;
+#else
+    for (;;) switch (ops[pc++]) {
+#endif
+
+    VM_CASE(OP_CONST) {
+        vm_stack[vm_sp++] = lval_copy(code->consts[ops[pc++]]);
+        VM_NEXT;
+    }
+
+    VM_CASE(OP_LOAD) {
+        lval* k = code->consts[ops[pc++]];
+        lval* x = lenv_peek(frame, k);
+        vm_stack[vm_sp++] = x ? lval_copy(x)
+            : lval_err("The symbol '%s' is not bound!", k->sym);
+        VM_NEXT;
+    }
+
+    VM_CASE(OP_CALL)
+    VM_CASE(OP_TAILCALL) {
+        tail = ops[pc-1] == OP_TAILCALL;
+        a = vm_args(ops[pc++]);
+        fn = vm_stack[--vm_sp];
+
+        // the first error among the function and its arguments wins
+        lval* err = NULL;
+        if (fn->type == LVAL_ERR) {
+            err = fn;
+        } else {
+            err = lval_args_error(a);
+            if (!err && fn->type != LVAL_FUN) { err = lval_not_function(fn); }
+            if (err) { lval_del(fn); }
+        }
+        if (err) {
+            lval_del(a);
+            if (!tail) { vm_stack[vm_sp++] = err; VM_NEXT; }
+            result = err;
+            goto done;
+        }
+        goto call;
+    }
+
+    VM_CASE(OP_CALLSYM)
+    VM_CASE(OP_TAILCALLSYM) {
+        tail = ops[pc-1] == OP_TAILCALLSYM;
+        lval* k = code->consts[ops[pc++]];
+        a = vm_args(ops[pc++]);
+
+        lval* x = lenv_peek(frame, k);
+        lval* err = NULL;
+        if (!x) {
+            err = lval_err("The symbol '%s' is not bound!", k->sym);
+        } else {
+            err = lval_args_error(a);
+            if (!err && x->type != LVAL_FUN) { err = lval_not_function(x); }
+        }
+        if (err) {
+            lval_del(a);
+            if (!tail) { vm_stack[vm_sp++] = err; VM_NEXT; }
+            result = err;
+            goto done;
+        }
+
+        fn = lval_copy(x);
+        goto call;
+    }
+
+    call:
+    // fn is a function we hold a reference to and a its arguments
+    if (tail && !fn->builtin
+        && (!lval_compiled(fn) || lval_body(frame, fn) != fn->body)) {
+        *fn_out = fn;
+        result = a;
+        goto done;
+    } else if (!tail || fn->builtin) {
+        lval* r = lval_call(frame, fn, a);
+        lval_del(fn);
+        if (!tail) { vm_stack[vm_sp++] = r; VM_NEXT; }
+        result = r;
+        goto done;
+    } else {
+        // a function calling itself keeps its frame, which lval_bind
+        // then owns
+        lenv* next = fn == f ? frame : NULL;
+        lval* r = lval_bind(frame, fn, a, &next);
+        if (fn == f) { frame = NULL; }
+        if (r) {
+            lval_del(fn);
+            result = r;
+            goto done;
+        }
+
+        if (frame) { lenv_del(frame); }
+        frame = next;
+        lval_del(f);
+        f = fn;
+
+        code = f->body->code;
+        ops = code->ops;
+        pc = 0;
+        vm_reserve(code->max_depth);
+        VM_NEXT;
+    }
+
+    VM_CASE(OP_GUARD) {
+        lval* x = lenv_peek(frame, code->consts[ops[pc]]);
+        lval* expect = code->consts[ops[pc+1]];
+        if (x && x->type == LVAL_FUN && x->builtin == expect->builtin) {
+            pc += 4;
+            VM_NEXT;
+        }
+
+        vm_stack[vm_sp++] = lval_eval(frame, lval_copy(code->consts[ops[pc+2]]));
+        pc = ops[pc+3];
+        VM_NEXT;
+    }
+
+    VM_CASE(OP_JUMPF) {
+        lval* cond = vm_stack[vm_sp-1];
+
+        // a bad condition becomes the value of the whole if, just as
+        // builtin_if would return it
+        if (cond->type == LVAL_ERR) {
+            pc = ops[pc+1];
+            VM_NEXT;
+        }
+        if (cond->type != LVAL_LONG) {
+            vm_stack[vm_sp-1] = lval_err(
+                "Function '%s' passed incorrect type for argument %i. "
+                "Got %s, Expected %s.",
+                "if", 0, ltype_name(cond->type), ltype_name(LVAL_LONG));
+            lval_del(cond);
+            pc = ops[pc+1];
+            VM_NEXT;
+        }
+
+        vm_sp--;
+        pc = cond->num_long ? pc + 2 : ops[pc];
+        lval_del(cond);
+        VM_NEXT;
+    }
+
+    VM_CASE(OP_JUMP) {
+        pc = ops[pc];
+        VM_NEXT;
+    }
+
+    VM_CASE(OP_RETURN) {
+        result = vm_stack[--vm_sp];
+        goto done;
+    }
+
+    VM_CASE(OP_INLINE) {
+        lval* guards = code->consts[ops[pc]];
+        int n = ops[pc+1];
+
+        for (int i = 0; i < guards->count; i += 2) {
+            lval* x = lenv_peek(frame, guards->cell[i]);
+            lval* expect = guards->cell[i+1];
+            if (x != expect && !(x && expect->builtin
+                    && x->type == LVAL_FUN && x->builtin == expect->builtin)) {
+                pc = ops[pc+2];
+                VM_NEXT;
+            }
+        }
+
+        // the first error among the arguments is the value of the call
+        for (int i = vm_sp - n; i < vm_sp; i++) {
+            if (vm_stack[i]->type != LVAL_ERR) { continue; }
+
+            lval* err = vm_stack[i];
+            vm_stack[i] = NULL;
+            while (n--) {
+                lval* x = vm_stack[--vm_sp];
+                if (x) { lval_del(x); }
+            }
+            vm_stack[vm_sp++] = err;
+            pc = ops[pc+3];
+            VM_NEXT;
+        }
+
+        pc += 4;
+        VM_NEXT;
+    }
+
+    VM_CASE(OP_ARG) {
+        vm_stack[vm_sp++] = lval_copy(vm_stack[base + ops[pc++]]);
+        VM_NEXT;
+    }
+
+    VM_CASE(OP_DROP) {
+        int n = ops[pc++];
+        lval* x = vm_stack[--vm_sp];
+        while (n--) { lval_del(vm_stack[--vm_sp]); }
+        vm_stack[vm_sp++] = x;
+        VM_NEXT;
+    }
+
+    VM_CASE(OP_GLOBAL) {
+        lval* k = code->consts[ops[pc++]];
+        lenv* g = frame;
+        while (!g->global) { g = g->par; }
+        lval* x = lenv_get_global(g, k);
+        vm_stack[vm_sp++] = x ? lval_copy(x)
+            : lval_err("The symbol '%s' is not bound!", k->sym);
+        VM_NEXT;
+    }
+
+#ifndef VM_COMPUTED_GOTO
+    }
+#endif
+
+done:
+    lval_del(f);
+    if (frame) { lenv_del(frame); }
+    return result;
+}
+
+lval* builtin_compile(lenv* e, lval* a) {
+    LASSERT_NUM("compile", a, 1);
+    LASSERT_TYPE("compile", a, 0, LVAL_FUN);
+    LASSERT(a, !a->cell[0]->builtin,
+        "Function 'compile' can only compile lambdas, not builtins!");
+
+    lval* f = lval_take(a, 0);
+    compile_lambda(e, f);
+    return f;
+}
+
+// prints the bytecode for a lambda, compiling it first if need be
+lval* builtin_disasm(lenv* e, lval* a) {
+    LASSERT_NUM("disasm", a, 1);
+    LASSERT_TYPE("disasm", a, 0, LVAL_FUN);
+    LASSERT(a, !a->cell[0]->builtin,
+        "Function 'disasm' can only show lambdas, not builtins!");
+
+    lval* f = a->cell[0];
+    compile_lambda(e, f);
+    lcode* c = f->body->code;
+
+    for (int pc = 0; pc < c->count; pc += op_operands[c->ops[pc]] + 1) {
+        int op = c->ops[pc];
+        printf("%04d %-12s", pc, op_names[op]);
+
+        for (int i = 1; i <= op_operands[op]; i++) {
+            printf(" %d", c->ops[pc+i]);
+        }
+
+        // show the constant an op refers to
+        if (op == OP_CONST || op == OP_LOAD || op == OP_INLINE
+            || op == OP_CALLSYM || op == OP_TAILCALLSYM || op == OP_GLOBAL) {
+            printf("    ; ");
+            lval_print(c->consts[c->ops[pc+1]]);
+        }
+        putchar('\n');
+    }
+
+    lval_del(a);
+    return lval_sexpr();
+}
+
+#ifdef TEDDY_JIT
+
+// jit for hot lambdas. once a lambda has been called JIT_THRESHOLD
+// times, its body is looked at, and if all it does is long arithmetic
+// (+, - and *), comparisons and ifs on its arguments and numbers, and
+// calls to itself, it is compiled to x86-64 machine code. the native
+// code only ever sees longs, so the checks all happen on the way in:
+// the arguments must all be longs, and the global names the body uses
+// must still mean what they did when it was compiled. otherwise the
+// call goes to the interpreter as usual.
+//
+// the code is a simple template compiler. every value ends up in rax,
+// with partial results pushed on the machine stack. arguments arrive
+// in the usual registers and live in the function's stack frame. a
+// call to itself in tail position overwrites them and jumps back to
+// the top, and other calls to itself are native calls. native code
+// never calls back into C
+
+typedef struct {
+    unsigned char* buf;
+    int count;
+    int cap;
+
+    lval* self;      // the lambda being compiled
+    lenv* root;      // the global env, where its names get looked up
+    lcode* code;     // gets the guards
+    int nargs;
+
+    int body;        // where calls to itself go
+    int start;       // where tail calls to itself go
+    int bail;        // where code that runs out of stack goes
+} ljit;
+
+// the stack pointer on the way into native code, and how low it may
+// go before the call bails out to the interpreter
+long jit_sp = 0;
+long jit_floor = 0;
+long jit_bailed = 0;
+
+// how much machine stack one run of native code may use
+#ifndef JIT_STACK
+#define JIT_STACK (512 * 1024)
+#endif
+
+// while above 0, calls don't go to native code. see jit_call
+int jit_off = 0;
+
+void jit_byte(ljit* j, int b) {
+    if (j->count == j->cap) {
+        j->cap = j->cap ? j->cap * 2 : 256;
+        j->buf = realloc(j->buf, j->cap);
+    }
+    j->buf[j->count++] = b;
+}
+
+void jit_bytes(ljit* j, char* bytes, int n) {
+    for (int i = 0; i < n; i++) { jit_byte(j, (unsigned char) bytes[i]); }
+}
+
+void jit_u32(ljit* j, unsigned int x) {
+    for (int i = 0; i < 4; i++) { jit_byte(j, (x >> (8 * i)) & 0xff); }
+}
+
+void jit_u64(ljit* j, unsigned long x) {
+    for (int i = 0; i < 8; i++) { jit_byte(j, (x >> (8 * i)) & 0xff); }
+}
+
+// points the rel32 operand at the given offset to target
+void jit_patch(ljit* j, int at, int target) {
+    unsigned int rel = target - (at + 4);
+    for (int i = 0; i < 4; i++) { j->buf[at+i] = (rel >> (8 * i)) & 0xff; }
+}
+
+// emits a rel32 operand for target, returning where it went
+int jit_rel32(ljit* j, int target) {
+    int at = j->count;
+    jit_u32(j, 0);
+    jit_patch(j, at, target);
+    return at;
+}
+
+// mov r11, address
+void jit_r11(ljit* j, void* address) {
+    jit_bytes(j, "\x49\xbb", 2);
+    jit_u64(j, (unsigned long) address);
+}
+
+// mov rax, [rbp - 8*(slot+1)]
+void jit_load_arg(ljit* j, int slot) {
+    jit_bytes(j, "\x48\x8b\x85", 3);
+    jit_u32(j, -8 * (slot + 1));
+}
+
+// mov [rbp - 8*(slot+1)], rax
+void jit_store_arg(ljit* j, int slot) {
+    jit_bytes(j, "\x48\x89\x85", 3);
+    jit_u32(j, -8 * (slot + 1));
+}
+
+// the global value of the name k, recording that the code depends on
+// it not changing
+lval* jit_global(ljit* j, lval* k) {
+    lval* x = lenv_peek(j->root, k);
+    if (!x) { return NULL; }
+
+    lcode_const(j->code, lval_copy(k));
+    lcode_const(j->code, lval_copy(x));
+    j->code->native_nguards++;
+    return x;
+}
+
+int jit_list(ljit* j, lval* v, int tail);
+
+int jit_part(ljit* j, lval* x, int tail) {
+    switch (x->type) {
+        case LVAL_LONG:
+            // mov rax, imm64
+            jit_bytes(j, "\x48\xb8", 2);
+            jit_u64(j, x->num_long);
+            return 1;
+
+        // only arguments, found by name among the formals. the slot a
+        // symbol was resolved to is only a hint, since the body can be
+        // shared by lambdas with their formals in another order
+        case LVAL_SYM: {
+            int slot = formal_slot(j->self->formals, x->sym);
+            if (slot == -1) { return 0; }
+            jit_load_arg(j, slot);
+            return 1;
+        }
+
+        case LVAL_SEXPR: return jit_list(j, x, tail);
+    }
+    return 0;
+}
+
+// compiles the parts of v, each pushed in turn
+int jit_push_parts(ljit* j, lval* v) {
+    for (int i = 1; i < v->count; i++) {
+        if (!jit_part(j, v->cell[i], 0)) { return 0; }
+        jit_byte(j, 0x50);                                 // push rax
+    }
+    return 1;
+}
+
+// compiles the list v as an s-expression
+int jit_list(ljit* j, lval* v, int tail) {
+    if (v->count == 0) { return 0; }
+    if (v->count == 1) { return jit_part(j, v->cell[0], tail); }
+
+    lval* h = v->cell[0];
+    if (h->type != LVAL_SYM || formal_slot(j->self->formals, h->sym) != -1) {
+        return 0;
+    }
+
+    lval* f = jit_global(j, h);
+    if (!f) { return 0; }
+    int n = v->count - 1;
+
+    if (f == j->self) {
+        if (n != j->nargs || !jit_push_parts(j, v)) { return 0; }
+
+        if (tail) {
+            // overwrite the arguments and start again
+            for (int i = n - 1; i >= 0; i--) {
+                jit_byte(j, 0x58);                         // pop rax
+                jit_store_arg(j, i);
+            }
+            jit_byte(j, 0xe9);                             // jmp start
+            jit_rel32(j, j->start);
+            return 1;
+        }
+
+        // pop rdi, rsi, rdx, rcx, r8, r9
+        char* pops[] = { "\x5f", "\x5e", "\x5a", "\x59", "\x41\x58", "\x41\x59" };
+        for (int i = n - 1; i >= 0; i--) {
+            jit_bytes(j, pops[i], i < 4 ? 1 : 2);
+        }
+        jit_byte(j, 0xe8);                                 // call body
+        jit_rel32(j, j->body);
+        return 1;
+    }
+
+    if (f->type != LVAL_FUN || !f->builtin) { return 0; }
+    lbuiltin b = f->builtin;
+
+    if (b == builtin_if) {
+        if (v->count != 4 || v->cell[2]->type != LVAL_QEXPR
+            || v->cell[3]->type != LVAL_QEXPR) {
+            return 0;
+        }
+
+        if (!jit_part(j, v->cell[1], 0)) { return 0; }
+        jit_bytes(j, "\x48\x85\xc0", 3);                   // test rax, rax
+        jit_bytes(j, "\x0f\x84", 2);                       // jz else
+        int to_else = jit_rel32(j, 0);
+
+        if (!jit_list(j, v->cell[2], tail)) { return 0; }
+        jit_byte(j, 0xe9);                                 // jmp end
+        int to_end = jit_rel32(j, 0);
+
+        jit_patch(j, to_else, j->count);
+        if (!jit_list(j, v->cell[3], tail)) { return 0; }
+        jit_patch(j, to_end, j->count);
+        return 1;
+    }
+
+    if (b == builtin_add || b == builtin_sub || b == builtin_mul) {
+        if (!jit_part(j, v->cell[1], 0)) { return 0; }
+
+        if (n == 1 && b == builtin_sub) {
+            jit_bytes(j, "\x48\xf7\xd8", 3);               // neg rax
+        }
+
+        for (int i = 2; i < v->count; i++) {
+            jit_byte(j, 0x50);                             // push rax
+            if (!jit_part(j, v->cell[i], 0)) { return 0; }
+            jit_bytes(j, "\x48\x89\xc1", 3);               // mov rcx, rax
+            jit_byte(j, 0x58);                             // pop rax
+
+            if (b == builtin_add) {
+                jit_bytes(j, "\x48\x01\xc8", 3);           // add rax, rcx
+            } else if (b == builtin_sub) {
+                jit_bytes(j, "\x48\x29\xc8", 3);           // sub rax, rcx
+            } else {
+                jit_bytes(j, "\x48\x0f\xaf\xc1", 4);       // imul rax, rcx
+            }
+        }
+        return 1;
+    }
+
+    // setcc al for each comparison, on the longs as builtin_ord does
+    int setcc = 0;
+    if (b == builtin_lt)  { setcc = 0x9c; }                // setl
+    if (b == builtin_gt)  { setcc = 0x9f; }                // setg
+    if (b == builtin_lte) { setcc = 0x9e; }                // setle
+    if (b == builtin_gte) { setcc = 0x9d; }                // setge
+    if (b == builtin_eq)  { setcc = 0x94; }                // sete
+    if (b == builtin_ne)  { setcc = 0x95; }                // setne
+
+    if (setcc && n == 2) {
+        if (!jit_part(j, v->cell[1], 0)) { return 0; }
+        jit_byte(j, 0x50);                                 // push rax
+        if (!jit_part(j, v->cell[2], 0)) { return 0; }
+        jit_bytes(j, "\x48\x89\xc1", 3);                   // mov rcx, rax
+        jit_byte(j, 0x58);                                 // pop rax
+        jit_bytes(j, "\x48\x39\xc8", 3);                   // cmp rax, rcx
+        jit_byte(j, 0x0f);
+        jit_byte(j, setcc);
+        jit_byte(j, 0xc0);
+        jit_bytes(j, "\x0f\xb6\xc0", 3);                   // movzx eax, al
+        return 1;
+    }
+
+    return 0;
+}
+
+// tries to compile the lambda f to native code
+void jit_lambda(lenv* e, lval* f) {
+
+    // it's only looked at the once
+    f->body->calls = -1;
+
+    // only plain formals, and nothing captured or already bound
+    int n = f->formals->count;
+    if (n > 6 || f->env->count) { return; }
+    for (int i = 0; i < n; i++) {
+        if (f->formals->cell[i]->sym == sym_amp()) { return; }
+    }
+
+    while (e->par) { e = e->par; }
+
+    // the code is kept on the body, but reads the arguments where f's
+    // formals put them, so it only runs for lambdas with the same ones
+    lcode* c = f->body->code ? f->body->code : lcode_new();
+    int formals = lcode_const(c, lval_copy(f->formals));
+    int guards = c->nconsts;
+    c->native_nguards = 0;
+
+    ljit jit = { NULL, 0, 0, f, e, c, n, 0, 0, 0 };
+    ljit* j = &jit;
+
+    // entry from C, with a pointer to the arguments in rdi
+    jit_byte(j, 0x55);                                     // push rbp
+    jit_r11(j, &jit_sp);
+    jit_bytes(j, "\x49\x89\x23", 3);                       // mov [r11], rsp
+    jit_bytes(j, "\x48\x89\xf8", 3);                       // mov rax, rdi
+
+    // mov rdi/rsi/rdx/rcx/r8/r9, [rax + 8*i]
+    char* loads[] = { "\x48\x8b\x78", "\x48\x8b\x70", "\x48\x8b\x50",
+        "\x48\x8b\x48", "\x4c\x8b\x40", "\x4c\x8b\x48" };
+    for (int i = 0; i < n; i++) {
+        jit_bytes(j, loads[i], 3);
+        jit_byte(j, 8 * i);
+    }
+    jit_byte(j, 0xe8);                                     // call body
+    int to_body = jit_rel32(j, 0);
+    jit_byte(j, 0x5d);                                     // pop rbp
+    jit_byte(j, 0xc3);                                     // ret
+
+    // out of stack: unwind everything and say so
+    j->bail = j->count;
+    jit_r11(j, &jit_sp);
+    jit_bytes(j, "\x49\x8b\x23", 3);                       // mov rsp, [r11]
+    jit_r11(j, &jit_bailed);
+    jit_bytes(j, "\x49\xc7\x03", 3);                       // mov qword [r11], 1
+    jit_u32(j, 1);
+    jit_byte(j, 0x5d);                                     // pop rbp
+    jit_byte(j, 0xc3);                                     // ret
+
+    // the body, with the arguments in registers
+    j->body = j->count;
+    jit_patch(j, to_body, j->body);
+    jit_byte(j, 0x55);                                     // push rbp
+    jit_bytes(j, "\x48\x89\xe5", 3);                       // mov rbp, rsp
+    jit_bytes(j, "\x48\x81\xec", 3);                       // sub rsp, 8*n
+    jit_u32(j, 8 * n);
+    jit_r11(j, &jit_floor);
+    jit_bytes(j, "\x49\x3b\x23", 3);                       // cmp rsp, [r11]
+    jit_bytes(j, "\x0f\x82", 2);                           // jb bail
+    jit_rel32(j, j->bail);
+
+    // mov [rbp - 8*(i+1)], rdi/rsi/rdx/rcx/r8/r9
+    char* stores[] = { "\x48\x89\xbd", "\x48\x89\xb5", "\x48\x89\x95",
+        "\x48\x89\x8d", "\x4c\x89\x85", "\x4c\x89\x8d" };
+    for (int i = 0; i < n; i++) {
+        jit_bytes(j, stores[i], 3);
+        jit_u32(j, -8 * (i + 1));
+    }
+
+    j->start = j->count;
+    int ok = jit_list(j, f->body, 1);
+    jit_byte(j, 0xc9);                                     // leave
+    jit_byte(j, 0xc3);                                     // ret
+
+    void* native = NULL;
+    if (ok) {
+        native = mmap(NULL, j->count, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (native == MAP_FAILED) { native = NULL; }
+    }
+
+    if (native) {
+        memcpy(native, j->buf, j->count);
+        mprotect(native, j->count, PROT_READ | PROT_EXEC);
+
+        c->native = native;
+        c->native_size = j->count;
+        c->native_args = n;
+        c->native_formals = formals;
+        c->native_guards = guards;
+        c->native_version = lenv_version;
+        c->native_ok = 1;
+    } else {
+        // drop the formals and guards that got recorded along the way
+        while (c->nconsts > formals) { lval_del(c->consts[--c->nconsts]); }
+        c->native_nguards = 0;
+    }
+
+    free(j->buf);
+    if (!f->body->code && native) { f->body->code = c; }
+    if (!f->body->code && !native) { lcode_del(c); }
+}
+
+// runs the lambda f natively on the n values in xs, if it can, taking
+// them. returns NULL, leaving them alone, if not
+lval* jit_call(lenv* e, lval* f, int n, lval** xs) {
+    lcode* c = f->body->code;
+
+    if (jit_off || f->env->count || f->formals->count != n
+        || c->native_args != n) {
+        return NULL;
+    }
+
+    lval* formals = c->consts[c->native_formals];
+    for (int i = 0; i < n; i++) {
+        if (f->formals->cell[i]->sym != formals->cell[i]->sym) { return NULL; }
+    }
+
+    long args[6];
+    for (int i = 0; i < n; i++) {
+        if (xs[i]->type != LVAL_LONG) { return NULL; }
+        args[i] = xs[i]->num_long;
+    }
+
+    // the globals the code depends on only need checking again after
+    // something global has changed
+    if (c->native_version != lenv_version) {
+        while (e->par) { e = e->par; }
+
+        c->native_ok = 1;
+        for (int i = 0; i < c->native_nguards; i++) {
+            lval* k = c->consts[c->native_guards + 2*i];
+            lval* x = c->consts[c->native_guards + 2*i + 1];
+            if (lenv_peek(e, k) != x) { c->native_ok = 0; }
+        }
+        c->native_version = lenv_version;
+    }
+    if (!c->native_ok) { return NULL; }
+
+    char here;
+    jit_floor = (long) &here - JIT_STACK;
+    jit_bailed = 0;
+    long r = ((long (*)(long*)) c->native)(args);
+
+    if (jit_bailed) {
+        // the recursion went too deep for native code. this call runs
+        // in the interpreter instead, and so does everything under it,
+        // since it's likely to go just as deep
+        jit_off++;
+        lenv* frame = NULL;
+        lval* x = lval_bind_args(e, f, n, xs, &frame);
+        if (!x) { x = lval_run(frame, f); }
+        jit_off--;
+        return x;
+    }
+
+    for (int i = 0; i < n; i++) { lval_del(xs[i]); }
+    return lval_num_long(r);
+}
+
+#else
+
+void jit_lambda(lenv* e, lval* f) {}
+lval* jit_call(lenv* e, lval* f, int n, lval** xs) { return NULL; }
+
+#endif
+
+void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
+    lval* k = lval_sym(name);
+    lval* v = lval_fun(func);
+    lenv_put(e, k, v);
+    lval_del(k); lval_del(v);
+}
+
+// prints how the global lookup caches are doing
+lval* builtin_cachestats(lenv* e, lval* a) {
+    long total = ic_hits + ic_misses;
+    printf("global lookups: %li, cache hits: %li (%.1f%%), misses: %li\n",
+        total, ic_hits, total ? 100.0 * ic_hits / total : 0.0, ic_misses);
+
+    lval_del(a);
+    return lval_sexpr();
+}
+
+// fills in the top-level env, which is the one global lookups cache
+void lenv_add_builtins(lenv* e) {
+    e->global = 1;
+
+    // list functions
+    lenv_add_builtin(e, "head", builtin_head);
+    lenv_add_builtin(e, "tail", builtin_tail);
+    lenv_add_builtin(e, "list", builtin_list);
+    lenv_add_builtin(e, "eval", builtin_eval);
+    lenv_add_builtin(e, "join", builtin_join);
     lenv_add_builtin(e,  "len", builtin_len);
     lenv_add_builtin(e, "init", builtin_init);
     lenv_add_builtin(e, "cons", builtin_cons);
+    lenv_add_builtin(e, "map", builtin_map);
+    lenv_add_builtin(e, "filter", builtin_filter);
+    lenv_add_builtin(e, "foldl", builtin_foldl);
+    lenv_add_builtin(e, "reverse", builtin_reverse);
+    lenv_add_builtin(e, "nth", builtin_nth);
+
+    // arithmetic functions
+    lenv_add_builtin(e, "+", builtin_add);
+    lenv_add_builtin(e, "-", builtin_sub);
+    lenv_add_builtin(e, "*", builtin_mul);
+    lenv_add_builtin(e, "/", builtin_div);
+    lenv_add_builtin(e, "%", builtin_mod);
+    lenv_add_builtin(e, "^", builtin_pow);
+
+    // variable functions
+    lenv_add_builtin(e, "def", builtin_def);
+    lenv_add_builtin(e, "=", builtin_put);
+    lenv_add_builtin(e, "defconst", builtin_defconst);
+    lenv_add_builtin(e, "printall", builtin_printall);
+    lenv_add_builtin(e, "cachestats", builtin_cachestats);
+    lenv_add_builtin(e, "stackeval", builtin_stackeval);
+
+    // comparison functions
+    lenv_add_builtin(e, "if", builtin_if);
+    lenv_add_builtin(e, "==", builtin_eq);
+    lenv_add_builtin(e, "!=", builtin_ne);
+    lenv_add_builtin(e, ">",  builtin_gt);
+    lenv_add_builtin(e, "<",  builtin_lt);
+    lenv_add_builtin(e, ">=", builtin_gte);
+    lenv_add_builtin(e, "<=", builtin_lte);
+
+    // string functions
+    lenv_add_builtin(e, "load", builtin_load);
+    lenv_add_builtin(e, "error", builtin_error);
+    lenv_add_builtin(e, "print", builtin_print);
+
+    // function functions
+    lenv_add_builtin(e, "\\", builtin_lambda);
+    lenv_add_builtin(e, "defmacro", builtin_defmacro);
+    lenv_add_builtin(e, "compile", builtin_compile);
+    lenv_add_builtin(e, "disasm", builtin_disasm);
+}
+
+// a call through a name borrows the function instead of copying it
+// out of the env. the arguments are evaluated first, since they are
+// what could rebind the name. this gives the first part of v to
+// evaluate
+int lval_parts_start(lval* v) {
+    return v->count > 1 && v->cell[0]->type == LVAL_SYM;
+}
+
+// once its parts from lval_parts_start on have been evaluated, checks
+// the s-expression v. for a call, returns the argument list and hands
+// back a reference to the function through f. otherwise f is set to
+// NULL and the value of v is returned
+lval* lval_parts_check(lenv* e, lval* v, lval** f) {
+    *f = NULL;
+
+    if (lval_parts_start(v)) {
+        lval* x = lenv_peek(e, v->cell[0]);
+        if (!x) {
+            lval* err = lenv_get(e, v->cell[0]);
+            lval_del(v);
+            return err;
+        }
+
+        // check for errors
+        for (int i = 1; i < v->count; i++) {
+            if (v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
+        }
+
+        if (x->type != LVAL_FUN) {
+            lval* err = lval_err(
+                "S-Expression started with incorrect type. "
+                "Got %s, wanted a %s.",
+                ltype_name(x->type), ltype_name(LVAL_FUN));
+
+            lval_del(v);
+            return err;
+        }
+
+        // drop the name and pass the rest as arguments
+        lval_del(lval_pop(v, 0));
+        *f = lval_copy(x);
+        return v;
+    }
+
+    // check for errors
+    for (int i = 0; i < v->count; i++) {
+        if (v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
+    }
+
+    // empty expression
+    if (v->count == 0) { return v; }
+
+    // single expression
+    if (v->count == 1) { return lval_take(v, 0); }
+
+    // make sure first element is a symbol
+    lval* x = lval_pop(v, 0);
+    if (x->type != LVAL_FUN) {
+        lval* err = lval_err(
+            "S-Expression started with incorrect type. "
+            "Got %s, wanted a %s.",
+            ltype_name(x->type), ltype_name(LVAL_FUN));
+        
+        lval_del(x); lval_del(v);
+        return err;
+    }
+
+    *f = x;
+    return v;
+}
+
+// evaluates the parts of the s-expression v and checks them, as above
+lval* lval_eval_parts(lenv* e, lval* v, lval** f) {
+
+    // children get replaced by their values, so make sure v is ours
+    v = lval_mut(v);
+
+    for (int i = lval_parts_start(v); i < v->count; i++) {
+        v->cell[i] = lval_eval(e, v->cell[i]);
+    }
+
+    return lval_parts_check(e, v, f);
+}
+
+lval* lval_eval_sexpr(lenv* e, lval* v) {
+    lval* m = lval_macro_at(e, v);
+    if (m) {
+        lval* x = lval_expand(e, m, v);
+        lval_del(v);
+        return lval_eval(e, x);
+    }
+
+    lval* f;
+    v = lval_eval_parts(e, v, &f);
+    if (!f) { return v; }
+
+    // call built-in operator
+    lval* result = lval_call(e, f, v);
+    lval_del(f);
+    return result;
+}
+
+// evaluates a part of some code without changing or consuming it
+lval* lval_eval_part(lenv* e, lval* x) {
+    if (x->type == LVAL_SYM) { return lenv_get(e, x); }
+    if (x->type == LVAL_SEXPR) { return lval_eval_code(e, x, NULL); }
+    return lval_copy(x);
+}
+
+// special forms. these are calls to if, def, = and \ written out in
+// full, with q-expressions where the builtin wants them, which
+// lval_eval_code carries out itself: only the parts that need it get
+// evaluated, and no argument list is made. the name still has to be
+// bound to the builtin when the call is made, otherwise it's a call
+// like any other
+enum { FORM_NONE, FORM_IF, FORM_VAR, FORM_LAMBDA };
+
+// which special form v could be, from its shape
+int lval_form(lval* v) {
+    if (v->count == 4 && v->cell[2]->type == LVAL_QEXPR
+        && v->cell[3]->type == LVAL_QEXPR) {
+        return FORM_IF;
+    }
+
+    if (v->count != 3 || v->cell[1]->type != LVAL_QEXPR) {
+        return FORM_NONE;
+    }
+
+    lval* syms = v->cell[1];
+    int all_syms = 1;
+    for (int i = 0; i < syms->count; i++) {
+        if (syms->cell[i]->type != LVAL_SYM) { all_syms = 0; }
+    }
+
+    // (\ {formals} {body}), which could also be a def of a q-expression
+    if (all_syms && v->cell[2]->type == LVAL_QEXPR) { return FORM_LAMBDA; }
+
+    // (def {x} value) with a single symbol
+    if (all_syms && syms->count == 1) { return FORM_VAR; }
+    return FORM_NONE;
+}
+
+// evaluates the parts of v from start on into a new argument list,
+// except for part pre, whose value x is already known
+lval* lval_code_args(lenv* e, lval* v, int start, int pre, lval* x) {
+    lval* a = lval_sexpr();
+    a->count = v->count - start;
+    a->cell = malloc(sizeof(lval*) * a->count);
+    for (int i = start; i < v->count; i++) {
+        a->cell[i-start] = i == pre ? x : lval_eval_part(e, v->cell[i]);
+    }
+    return a;
+}
+
+// evaluates the list v as an s-expression, whatever its tag, without
+// changing or consuming it. so function bodies run as they are rather
+// than being copied first, and the values of the parts go straight
+// into the argument list. if and eval carry on with the expression
+// they pick rather than evaluating it themselves. when fn is given, v
+// is in tail position: a call to a lambda isn't made, instead its
+// arguments are returned and the function handed back through fn
+lval* lval_eval_code(lenv* e, lval* v, lval** fn) {
+
+    // the expression picked by an if or eval, held while it runs
+    lval* held = NULL;
+    lval* r;
+
+    for (;;) {
+        if (v->count == 0) {
+            r = lval_sexpr();
+            break;
+        }
+
+        // a macro call carries on in its expansion
+        lval* m = lval_macro_at(e, v);
+        if (m) {
+            lval* x = lval_expand(e, m, v);
+            if (x->type != LVAL_SEXPR) {
+                r = lval_eval(e, x);
+                break;
+            }
+
+            v = x;
+            if (held) { lval_del(held); }
+            held = x;
+            continue;
+        }
+
+        // a lone expression is evaluated in its place
+        if (v->count == 1) {
+            if (v->cell[0]->type == LVAL_SEXPR) {
+                v = v->cell[0];
+                continue;
+            }
+            r = lval_eval_part(e, v->cell[0]);
+            break;
+        }
+
+        // as in lval_parts_check, a call through a name gets its
+        // arguments evaluated before the name is looked up
+        int start = lval_parts_start(v);
+        lval* a = NULL;
+
+        // a call that has only ever been a builtin on two longs skips
+        // building an argument list. when that stops being true it
+        // goes back to the general way, for good
+        if (v->spec > SPEC_GENERIC) {
+            lval* x = lval_eval_part(e, v->cell[1]);
+            lval* y = lval_eval_part(e, v->cell[2]);
+            lval* f = lenv_peek(e, v->cell[0]);
+            long n;
+
+            if (f && f->type == LVAL_FUN
+                && f->builtin == spec_builtins[v->spec]
+                && x->type == LVAL_LONG && y->type == LVAL_LONG) {
+                builtin_long_op(f->builtin, x->num_long, y->num_long, &n);
+                lval_del(y);
+                if (x->refs == 1) {
+                    r = x;
+                    r->num_long = n;
+                } else {
+                    lval_del(x);
+                    r = lval_num_long(n);
+                }
+                break;
+            }
+
+            v->spec = SPEC_GENERIC;
+            a = lval_sexpr();
+            lval_add(a, x);
+            lval_add(a, y);
+        }
+
+        int form = start && !a ? lval_form(v) : FORM_NONE;
+
+        if (form) {
+            // the one part that needs evaluating
+            int pre = form == FORM_IF ? 1 : 2;
+            lval* c = lval_eval_part(e, v->cell[pre]);
+            lval* x = lenv_peek(e, v->cell[0]);
+            lbuiltin b = x && x->type == LVAL_FUN ? x->builtin : NULL;
+
+            if (form == FORM_IF && b == builtin_if) {
+                if (c->type == LVAL_ERR) {
+                    r = c;
+                    break;
+                }
+                if (c->type != LVAL_LONG) {
+                    r = lval_err(
+                        "Function '%s' passed incorrect type for argument %i. "
+                        "Got %s, Expected %s.",
+                        "if", 0, ltype_name(c->type), ltype_name(LVAL_LONG));
+                    lval_del(c);
+                    break;
+                }
+
+                // carry on in the branch, where it is in the code
+                v = v->cell[c->num_long ? 2 : 3];
+                lval_del(c);
+                continue;
+            }
+
+            int var = form == FORM_VAR
+                || (form == FORM_LAMBDA && v->cell[1]->count == 1);
+            if (var && (b == builtin_def || b == builtin_put)) {
+                if (c->type == LVAL_ERR) {
+                    r = c;
+                    break;
+                }
+                r = lval_const_check(v->cell[1]);
+                if (r) {
+                    lval_del(c);
+                    break;
+                }
+                if (b == builtin_def) {
+                    lenv_def(e, v->cell[1]->cell[0], c);
+                } else {
+                    lenv_put(e, v->cell[1]->cell[0], c);
+                }
+                lval_del(c);
+                r = lval_sexpr();
+                break;
+            }
+
+            if (form == FORM_LAMBDA && b == builtin_lambda) {
+                lval_del(c);
+                r = lval_make_lambda(e,
+                    lval_copy(v->cell[1]), lval_copy(v->cell[2]));
+                break;
+            }
+
+            // not the builtin after all
+            a = lval_code_args(e, v, start, pre, c);
+        }
+
+        if (!a) { a = lval_code_args(e, v, start, -1, NULL); }
+
+        lval* f = NULL;
+        if (start) {
+            lval* x = lenv_peek(e, v->cell[0]);
+            if (!x) {
+                lval_del(a);
+                r = lenv_get(e, v->cell[0]);
+                break;
+            }
+            f = x;
+        }
+
+        // check for errors
+        r = lval_args_error(a);
+        if (r) {
+            lval_del(a);
+            break;
+        }
+
+        if (!f) { f = lval_pop(a, 0); }
+        if (f->type != LVAL_FUN) {
+            r = lval_not_function(f);
+            if (!start) { lval_del(f); }
+            lval_del(a);
+            break;
+        }
+
+        // the first time through, note what kind of call this is
+        if (v->spec == SPEC_NONE) {
+            v->spec = start && a->count == 2
+                && a->cell[0]->type == LVAL_LONG
+                && a->cell[1]->type == LVAL_LONG
+                ? spec_kind(f->builtin) : SPEC_GENERIC;
+        }
+        if (start) { f = lval_copy(f); }
+
+        if (f->builtin == builtin_if || f->builtin == builtin_eval) {
+            lval* x = f->builtin == builtin_if ? if_pick(a) : eval_pick(a);
+            lval_del(f);
+            if (x->type == LVAL_ERR) {
+                r = x;
+                break;
+            }
+
+            // v may belong to what was held before, so swap after
+            v = x;
+            if (held) { lval_del(held); }
+            held = x;
+            continue;
+        }
+
+        if (fn && !f->builtin) {
+            *fn = f;
+            r = a;
+            break;
+        }
+
+        r = lval_call(e, f, a);
+        lval_del(f);
+        break;
+    }
+
+    if (held) { lval_del(held); }
+    return r;
+}
+
+// explicit stack evaluator. instead of recursing, it keeps what's left
+// to do on a stack of its own: an s-expression with some of its parts
+// evaluated, or a lambda body running in its frame. lambda calls, if
+// and eval are handled here rather than through lval_call and the
+// builtins, so nothing recurses on the C stack, and a call in tail
+// position replaces the body it ends. like lval_eval_code, it reads
+// the code without changing it, putting the values of the parts into
+// an argument list of their own, so a body runs where it is instead
+// of being copied for every call
+typedef struct {
+    lval* v;     // the s-expression, or NULL for a body
+    lval* a;     // the values of the parts of v so far
+    int i;       // the part of v being evaluated
+    lenv* e;     // the env v is evaluated in, or the body's frame
+    lval* f;     // the function whose body is running
+    lval* held;  // what v belongs to, if this entry has to free it
+} lkont;
+
+lkont* kont_stack = NULL;
+int kont_count = 0;
+int kont_cap = 0;
+
+// makes room for one more entry, or returns 0 if that's over the limit
+int kont_reserve(void) {
+    if (kont_count >= eval_limit) { return 0; }
+    if (kont_count == kont_cap) {
+        kont_cap = kont_cap ? kont_cap * 2 : 256;
+        kont_stack = realloc(kont_stack, sizeof(lkont) * kont_cap);
+    }
+    return 1;
+}
 
-    // arithmetic functions
-    lenv_add_builtin(e, "+", builtin_add);
-    lenv_add_builtin(e, "-", builtin_sub);
-    lenv_add_builtin(e, "*", builtin_mul);
-    lenv_add_builtin(e, "/", builtin_div);
-    lenv_add_builtin(e, "%", builtin_mod);
-    lenv_add_builtin(e, "^", builtin_pow);
+// a builtin like map or load that calls back into the evaluator does
+// so on the C stack, starting a nested run. how much C stack the runs
+// nested inside the outermost one may use, and where that one started
+#ifndef EVAL_C_STACK
+#define EVAL_C_STACK (4 * 1024 * 1024)
+#endif
 
-    // variable functions
-    lenv_add_builtin(e, "def", builtin_def);
-    lenv_add_builtin(e, "=", builtin_put);
-    lenv_add_builtin(e, "printall", builtin_printall);
+int kont_runs = 0;
+char* kont_c_top = NULL;
+
+// evaluates v in e. or, when fn is given, v is NULL and e is a frame
+// for fn, and both are taken: fn's body is run in it
+lval* lval_eval_stack(lenv* e, lval* v, lval* fn) {
+    char here;
+    if (!kont_runs) { kont_c_top = &here; }
+    if (labs(kont_c_top - &here) > EVAL_C_STACK) {
+        if (fn) {
+            lenv_del(e);
+            lval_del(fn);
+        } else {
+            lval_del(v);
+        }
+        return lval_err("Evaluation went past the stack limit "
+            "in calls made by builtins!");
+    }
+    kont_runs++;
+
+    // entries below base belong to an evaluation further out, one that
+    // got here through a builtin like load or map
+    int base = kont_count;
+    lval* r;
+    lval* f = fn;
+    lkont* k;
+
+    // what v belongs to, when it's ours to free once v is done. v is
+    // borrowed otherwise, from a body or an entry below
+    lval* own = v;
+    if (f) { goto body; }
+
+eval:
+    // v is to be evaluated in e. anything but an s-expression evaluates
+    // without recursing
+    if (v->type != LVAL_SEXPR) {
+        r = lval_eval_part(e, v);
+        if (own) { lval_del(own); }
+        goto ret;
+    }
 
-    // comparison functions
-    lenv_add_builtin(e, "if", builtin_if);
-    lenv_add_builtin(e, "==", builtin_eq);
-    lenv_add_builtin(e, "!=", builtin_ne);
-    lenv_add_builtin(e, ">",  builtin_gt);
-    lenv_add_builtin(e, "<",  builtin_lt);
-    lenv_add_builtin(e, ">=", builtin_gte);
-    lenv_add_builtin(e, "<=", builtin_lte);
+list:
+    // v is a list to evaluate as an s-expression, whatever its tag. a
+    // macro call carries on in its expansion. the macro itself runs on
+    // the C stack
+    f = lval_macro_at(e, v);
+    if (f) {
+        lval* x = lval_expand(e, f, v);
+        if (own) { lval_del(own); }
+        own = v = x;
+        goto eval;
+    }
 
-    // string functions
-    lenv_add_builtin(e, "load", builtin_load);
-    lenv_add_builtin(e, "error", builtin_error);
-    lenv_add_builtin(e, "print", builtin_print);
+    // a lone expression is evaluated in its place
+    if (v->count == 1) {
+        v = v->cell[0];
+        goto eval;
+    }
 
-    // function functions
-    lenv_add_builtin(e, "\\", builtin_lambda);
+    if (v->count == 0) {
+        r = lval_sexpr();
+        if (own) { lval_del(own); }
+        goto ret;
+    }
+
+    if (!kont_reserve()) {
+        if (own) { lval_del(own); }
+        r = lval_err("Evaluation went past the stack limit of %i!",
+            eval_limit);
+        goto ret;
+    }
+    k = &kont_stack[kont_count++];
+    k->v = v;
+    k->a = lval_sexpr();
+    k->a->cell = malloc(sizeof(lval*) * v->count);
+    k->i = lval_parts_start(v);
+    k->e = e;
+    k->f = NULL;
+    k->held = own;
+
+    // a call through a name keeps the name, for lval_parts_check
+    if (k->i) { k->a->cell[k->a->count++] = lval_copy(v->cell[0]); }
+
+next:
+    // evaluate the rest of the parts of the s-expression on top. only
+    // parts that are s-expressions need the stack
+    k = &kont_stack[kont_count-1];
+    while (k->i < k->v->count) {
+        lval* x = k->v->cell[k->i];
+        if (x->type == LVAL_SEXPR) {
+            v = x;
+            e = k->e;
+            own = NULL;
+            goto list;
+        }
+        k->a->cell[k->a->count++] = lval_eval_part(k->e, x);
+        k->i++;
+    }
+
+    kont_count--;
+    e = k->e;
+    if (k->held) { lval_del(k->held); }
+    v = lval_parts_check(e, k->a, &f);
+    if (!f) {
+        r = v;
+        goto ret;
+    }
+
+    // f is called with the arguments v. the branch if picks, or the
+    // expression given to eval, carries on in the place of the call
+    if (f->builtin == builtin_if || f->builtin == builtin_eval) {
+        v = f->builtin == builtin_if ? if_pick(v) : eval_pick(v);
+        lval_del(f);
+        own = v;
+        if (v->type == LVAL_ERR) { goto eval; }
+        goto list;
+    }
+
+    if (f->builtin) {
+        r = f->builtin(e, v);
+        lval_del(f);
+        goto ret;
+    }
+
+    {
+        // a call that ends a body replaces it, and a function calling
+        // itself keeps using the same frame
+        k = kont_count > base && !kont_stack[kont_count-1].v
+            ? &kont_stack[kont_count-1] : NULL;
+        lenv* frame = k && k->f == f ? k->e : NULL;
+
+        r = lval_bind(e, f, v, &frame);
+        if (k) {
+            if (k->f != f) { lenv_del(k->e); }
+            lval_del(k->f);
+            kont_count--;
+        }
+
+        if (r) {
+            lval_del(f);
+            goto ret;
+        }
+        e = frame;
+    }
+
+body:
+    // e is a frame for f, both ours, and f's body runs in it next
+    if (!kont_reserve()) {
+        lenv_del(e);
+        lval_del(f);
+        r = lval_err("Evaluation went past the stack limit of %i!",
+            eval_limit);
+        goto ret;
+    }
+    k = &kont_stack[kont_count++];
+    k->v = NULL;
+    k->a = NULL;
+    k->e = e;
+    k->f = f;
+    k->held = NULL;
+
+    // the body stays f's, which the entry holds while it runs
+    v = lval_body(e, f);
+    own = NULL;
+    goto list;
+
+ret:
+    // r is the value of what was last evaluated. it goes to the entry
+    // on top, if there's one left
+    if (kont_count == base) {
+        kont_runs--;
+        return r;
+    }
+
+    k = &kont_stack[kont_count-1];
+    if (!k->v) {
+        lenv_del(k->e);
+        lval_del(k->f);
+        kont_count--;
+        goto ret;
+    }
+
+    k->a->cell[k->a->count++] = r;
+    k->i++;
+    goto next;
 }
 
-lval* lval_eval_sexpr(lenv* e, lval* v) {
+// teddyc, the ahead of time compiler. `parsing --teddyc prog.tdy prog.c`
+// turns a file of teddy into a c program that does what loading the
+// file would. the program includes this file with TEDDY_LIBRARY
+// defined, which leaves out the repl, and builds the same way:
+//
+//   cc -std=c99 -Wall prog.c mpc.c -ledit -lm -o prog
+//
+// each top-level (def {name} (\ {formals} {body})) becomes a c function,
+// bound to the name as a builtin. its body runs as c: arguments are c
+// variables, if is a branch, calls to itself in tail position are a
+// loop, calls to other compiled functions are c calls, and + - * and
+// the comparisons on two longs are worked out inline. anything else
+// calls the builtin through the name, like the interpreter would. calls
+// that depend on a name check it's still bound to the same thing first,
+// and go the long way if not. every other top-level form, and any
+// function teddyc can't compile, is evaluated by the interpreter when
+// the program starts
+
+// the parts of a compiled program that are the same for every program
+
+typedef lval* (*tc_fn)(lenv* e, lval** x);
+
+// a list of the given type holding n values
+lval* tc_list(int type, int n, ...) {
+    lval* v = type == LVAL_QEXPR ? lval_qexpr() : lval_sexpr();
+
+    va_list va;
+    va_start(va, n);
+    for (int i = 0; i < n; i++) { lval_add(v, va_arg(va, lval*)); }
+    va_end(va);
+    return v;
+}
+
+// whether none of the n values are errors
+int tc_ok(int n, lval** x) {
+    for (int i = 0; i < n; i++) {
+        if (x[i]->type == LVAL_ERR) { return 0; }
+    }
+    return 1;
+}
+
+// carries out an s-expression whose parts have been evaluated, the
+// way the interpreter does
+lval* tc_apply(lenv* e, lval* v) {
+    lval* f;
+    v = lval_parts_check(e, v, &f);
+    if (!f) { return v; }
 
-    // evaluate children
+    lval* r = lval_call(e, f, v);
+    lval_del(f);
+    return r;
+}
+
+// calls whatever is bound to the name k on the n values in x
+lval* tc_callv(lenv* e, lval* k, int n, lval** x) {
+    lval* v = lval_add(lval_sexpr(), lval_copy(k));
+    for (int i = 0; i < n; i++) { lval_add(v, x[i]); }
+    return tc_apply(e, v);
+}
+
+// calls the compiled function fn directly, if k is still bound to its
+// builtin f
+lval* tc_callf(lenv* e, lval* k, lval* f, tc_fn fn, int n, lval** x) {
+    if (lenv_peek(e, k) == f && tc_ok(n, x)) { return fn(e, x); }
+    return tc_callv(e, k, n, x);
+}
+
+// a call to k, bound to the arithmetic or comparison builtin b when the
+// program was compiled, on x and y. longs get worked out here, the same
+// way the builtin would
+lval* tc_op2(lenv* e, lval* k, lbuiltin b, lval* x, lval* y) {
+    lval* f = lenv_peek(e, k);
+    long r;
+
+    if (f && f->builtin == b && x->type == LVAL_LONG && y->type == LVAL_LONG
+        && builtin_long_op(b, x->num_long, y->num_long, &r)) {
+        lval_del(x);
+        lval_del(y);
+        return lval_num_long(r);
+    }
+
+    lval* xs[] = { x, y };
+    return tc_callv(e, k, 2, xs);
+}
+
+// the condition of an if, which gets used up: 1 if true, 0 if false,
+// or -1 with *c replaced by the error the interpreter would give
+int tc_test(lval** c) {
+    if ((*c)->type == LVAL_LONG) {
+        int t = (*c)->num_long != 0;
+        lval_del(*c);
+        return t;
+    }
+
+    if ((*c)->type != LVAL_ERR) {
+        *c = if_pick(tc_list(LVAL_SEXPR, 3, *c, lval_qexpr(), lval_qexpr()));
+    }
+    return -1;
+}
+
+// evaluates a top-level form, the way load does
+void tc_top(lenv* e, lval* v) {
+    lval* x = lval_eval(e, v);
+    if (x->type == LVAL_ERR) { lval_println(x); }
+    lval_del(x);
+}
+
+#ifndef TEDDY_LIBRARY
+
+// the compiler itself
+
+typedef struct {
+    FILE* out;
+    lenv* e;
+
+    lval* syms;      // names the code uses, as tc_k[i]
+    lval* consts;    // q-expressions it uses, as tc_c[i]
+    lval* defined;   // names given a value by a top-level def
+    lval* local;     // names bound anywhere else: formals, = and macros
+    lval* macros;    // names of macros
+    lval* names;     // the name of each compiled function tc_f<i>
+    lval* funs;      // and its (\ {formals} {body})
+
+    int fun;         // the function being compiled
+    lval* formals;   // and its formals
+    int temps;
+} lteddyc;
+
+int tc_has(lval* v, char* sym) {
     for (int i = 0; i < v->count; i++) {
-        v->cell[i] = lval_eval(e, v->cell[i]);
+        if (strcmp(v->cell[i]->sym, sym) == 0) { return 1; }
     }
+    return 0;
+}
 
-    // check for errors
+// the index of sym in the list v, adding it if it isn't there
+int tc_index(lval* v, char* sym) {
     for (int i = 0; i < v->count; i++) {
-        if (v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
+        if (strcmp(v->cell[i]->sym, sym) == 0) { return i; }
     }
+    lval_add(v, lval_sym(sym));
+    return v->count - 1;
+}
 
-    // empty expression
-    if (v->count == 0) { return v; }
+int tc_formal(lteddyc* t, lval* x) {
+    for (int i = 0; t->formals && i < t->formals->count; i++) {
+        if (strcmp(t->formals->cell[i]->sym, x->sym) == 0) { return i; }
+    }
+    return -1;
+}
 
-    // single expression
-    if (v->count == 1) { return lval_take(v, 0); }
+// the value a builtin has in the global env, if the program never
+// gives it a value of its own
+lbuiltin tc_builtin(lteddyc* t, lval* x) {
+    if (x->type != LVAL_SYM || tc_has(t->defined, x->sym)
+        || tc_has(t->local, x->sym)) {
+        return NULL;
+    }
 
-    // make sure first element is a symbol
-    lval* f = lval_pop(v, 0);
-    if (f->type != LVAL_FUN) {
-        lval* err = lval_err(
-            "S-Expression started with incorrect type. "
-            "Got %s, wanted a %s.",
-            ltype_name(f->type), ltype_name(LVAL_FUN));
-        
-        lval_del(f); lval_del(v);
-        return err;
+    lval* f = lenv_peek(t->e, x);
+    return f && f->type == LVAL_FUN ? f->builtin : NULL;
+}
+
+// the compiled function a call to x goes to, or -1
+int tc_target(lteddyc* t, lval* x) {
+    if (x->type != LVAL_SYM || tc_formal(t, x) != -1) { return -1; }
+
+    // a name can be defined more than once. the last one is likeliest
+    // to be bound when the call is made, and the check before the call
+    // sorts out the rest
+    for (int i = t->names->count - 1; i >= 0; i--) {
+        if (strcmp(t->names->cell[i]->sym, x->sym) == 0) { return i; }
+    }
+    return -1;
+}
+
+// an (if c {t} {e}) whose branches get compiled as code
+int tc_is_if(lteddyc* t, lval* v) {
+    return v->count == 4 && tc_builtin(t, v->cell[0]) == builtin_if
+        && v->cell[2]->type == LVAL_QEXPR && v->cell[3]->type == LVAL_QEXPR;
+}
+
+// records the names the program binds other than with a top-level def
+void tc_scan(lteddyc* t, lval* v, int top) {
+    if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) { return; }
+
+    if (v->count >= 2 && v->cell[0]->type == LVAL_SYM
+        && v->cell[1]->type == LVAL_QEXPR) {
+
+        char* h = v->cell[0]->sym;
+        int def = strcmp(h, "def") == 0;
+        int macro = strcmp(h, "defmacro") == 0;
+
+        if (def || macro || strcmp(h, "=") == 0 || strcmp(h, "\\") == 0) {
+            lval* syms = v->cell[1];
+            for (int i = 0; i < syms->count; i++) {
+                if (syms->cell[i]->type != LVAL_SYM) { continue; }
+                char* s = syms->cell[i]->sym;
+
+                if (def && top) { tc_index(t->defined, s); }
+                else if (!def) { tc_index(t->local, s); }
+                if (macro && i == 0) { tc_index(t->macros, s); }
+            }
+        }
     }
 
-    // call built-in operator
-    lval* result = lval_call(e, f, v);
-    lval_del(f);
-    return result;
+    for (int i = 0; i < v->count; i++) { tc_scan(t, v->cell[i], 0); }
 }
 
-int main(int argc, char** argv) {
+// whether code can be compiled. the compiled code only knows about the
+// function's own formals and globals. a name that the program binds
+// locally anywhere else, as a formal or with =, might be a captured
+// variable wherever it's used, so rather than work out which, anything
+// using one is left to the interpreter. so is anything that uses =,
+// which binds in the frame, or a macro
+int tc_check(lteddyc* t, lval* x, int code) {
+    switch (x->type) {
+        case LVAL_SYM:
+            if (tc_formal(t, x) != -1) { return code; }
+            return !tc_has(t->local, x->sym) && !tc_has(t->macros, x->sym)
+                && strcmp(x->sym, "=") != 0;
+
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            // a q-expression in code is code only as the branch of an
+            // if. otherwise it's data, which can't mention the formals
+            for (int i = 0; i < x->count; i++) {
+                lval* y = x->cell[i];
+                int branch = code && i >= 2 && tc_is_if(t, x);
+                int part = code && (y->type != LVAL_QEXPR || branch);
+                if (!tc_check(t, y, part)) { return 0; }
+            }
+            return 1;
+    }
+    return 1;
+}
+
+// whether the top-level form v is a def of a lambda teddyc can compile
+int tc_compilable(lteddyc* t, lval* v) {
+    if (v->type != LVAL_SEXPR || v->count != 3
+        || tc_builtin(t, v->cell[0]) != builtin_def
+        || v->cell[1]->type != LVAL_QEXPR || v->cell[1]->count != 1
+        || v->cell[1]->cell[0]->type != LVAL_SYM) {
+        return 0;
+    }
+
+    lval* l = v->cell[2];
+    if (l->type != LVAL_SEXPR || l->count != 3
+        || tc_builtin(t, l->cell[0]) != builtin_lambda
+        || l->cell[1]->type != LVAL_QEXPR || l->cell[2]->type != LVAL_QEXPR) {
+        return 0;
+    }
+
+    for (int i = 0; i < l->cell[1]->count; i++) {
+        lval* s = l->cell[1]->cell[i];
+        if (s->type != LVAL_SYM || strcmp(s->sym, "&") == 0) { return 0; }
+    }
+
+    t->formals = l->cell[1];
+    int ok = tc_check(t, l->cell[2], 1);
+    t->formals = NULL;
+    return ok;
+}
+
+// writes s as a c string literal
+void tc_string(FILE* out, char* s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') { fprintf(out, "\\%c", c); }
+        else if (c == '\n') { fputs("\\n", out); }
+        else if (c == '\t') { fputs("\\t", out); }
+        else if (c < 32 || c > 126) { fprintf(out, "\\%03o", c); }
+        else { fputc(c, out); }
+    }
+    fputc('"', out);
+}
+
+// writes c code that makes the value v
+void tc_value(FILE* out, lval* v) {
+    switch (v->type) {
+        case LVAL_LONG:
+            if (v->num_long == LONG_MIN) {
+                fprintf(out, "lval_num_long(LONG_MIN)");
+            } else {
+                fprintf(out, "lval_num_long(%ldL)", v->num_long);
+            }
+        break;
+        case LVAL_DOUBLE:
+            fprintf(out, "lval_num_double(%.17g)", v->num_double);
+        break;
+        case LVAL_STR:
+            fputs("lval_str(", out); tc_string(out, v->str); fputc(')', out);
+        break;
+        case LVAL_SYM:
+            fputs("lval_sym(", out); tc_string(out, v->sym); fputc(')', out);
+        break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            fprintf(out, "tc_list(%s, %d",
+                v->type == LVAL_QEXPR ? "LVAL_QEXPR" : "LVAL_SEXPR", v->count);
+            for (int i = 0; i < v->count; i++) {
+                fputs(", ", out);
+                tc_value(out, v->cell[i]);
+            }
+            fputc(')', out);
+        break;
+    }
+}
+
+void tc_indent(lteddyc* t, int depth) {
+    fprintf(t->out, "%*s", 4 * depth, "");
+}
+
+int tc_list_code(lteddyc* t, lval* v, int tail, int depth);
+
+// writes statements that evaluate x into a new temporary, and returns
+// its number
+int tc_code(lteddyc* t, lval* x, int tail, int depth) {
+    if (x->type == LVAL_SEXPR) { return tc_list_code(t, x, tail, depth); }
+
+    int n = t->temps++;
+    tc_indent(t, depth);
+    fprintf(t->out, "lval* t%d = ", n);
+
+    switch (x->type) {
+        case LVAL_SYM: {
+            int i = tc_formal(t, x);
+            if (i != -1) {
+                fprintf(t->out, "lval_copy(x[%d]);\n", i);
+            } else {
+                fprintf(t->out, "lenv_get(e, tc_k[%d]);\n",
+                    tc_index(t->syms, x->sym));
+            }
+        }
+        break;
+
+        case LVAL_QEXPR:
+            lval_add(t->consts, lval_copy(x));
+            fprintf(t->out, "lval_copy(tc_c[%d]);\n", t->consts->count - 1);
+        break;
+
+        default:
+            tc_value(t->out, x);
+            fputs(";\n", t->out);
+        break;
+    }
+    return n;
+}
+
+// evaluates parts from..count-1 of v into temporaries, and writes an
+// array of them, returning its number
+int tc_parts(lteddyc* t, lval* v, int from, int depth) {
+    int ts[v->count];
+    for (int i = from; i < v->count; i++) {
+        ts[i] = tc_code(t, v->cell[i], 0, depth);
+    }
+
+    int n = t->temps++;
+    tc_indent(t, depth);
+    fprintf(t->out, "lval* t%d[] = {", n);
+    for (int i = from; i < v->count; i++) {
+        fprintf(t->out, "%s t%d", i > from ? "," : "", ts[i]);
+    }
+    fputs(" };\n", t->out);
+    return n;
+}
+
+int tc_list_code(lteddyc* t, lval* v, int tail, int depth) {
+    FILE* out = t->out;
+
+    if (v->count == 0) {
+        int n = t->temps++;
+        tc_indent(t, depth);
+        fprintf(out, "lval* t%d = lval_sexpr();\n", n);
+        return n;
+    }
 
-    // parsers
+    if (v->count == 1) { return tc_code(t, v->cell[0], tail, depth); }
+
+    if (tc_is_if(t, v)) {
+        int c = tc_code(t, v->cell[1], 0, depth);
+        int n = t->temps++;
+
+        tc_indent(t, depth); fprintf(out, "lval* t%d;\n", n);
+        tc_indent(t, depth); fprintf(out, "int c%d = tc_test(&t%d);\n", n, c);
+        tc_indent(t, depth); fprintf(out, "if (c%d < 0) {\n", n);
+        tc_indent(t, depth + 1); fprintf(out, "t%d = t%d;\n", n, c);
+
+        for (int i = 2; i <= 3; i++) {
+            tc_indent(t, depth);
+            fprintf(out, i == 2 ? "} else if (c%d) {\n" : "} else {\n", n);
+            int b = tc_list_code(t, v->cell[i], tail, depth + 1);
+            tc_indent(t, depth + 1); fprintf(out, "t%d = t%d;\n", n, b);
+        }
+        tc_indent(t, depth); fputs("}\n", out);
+        return n;
+    }
+
+    lval* h = v->cell[0];
+    int n;
+
+    // anything but a call through a global name: evaluate the lot
+    if (h->type != LVAL_SYM || tc_formal(t, h) != -1) {
+        int a = tc_parts(t, v, 0, depth);
+        n = t->temps++;
+        tc_indent(t, depth);
+        fprintf(out, "lval* t%d = tc_apply(e, tc_list(LVAL_SEXPR, %d",
+            n, v->count);
+        for (int i = 0; i < v->count; i++) { fprintf(out, ", t%d[%d]", a, i); }
+        fputs("));\n", out);
+        return n;
+    }
+
+    int k = tc_index(t->syms, h->sym);
+    int args = v->count - 1;
+    int f = tc_target(t, h);
+    if (f != -1 && t->funs->cell[f]->cell[1]->count != args) { f = -1; }
+
+    lbuiltin b = tc_builtin(t, h);
+    char* op = NULL;
+    if (b == builtin_add) { op = "builtin_add"; }
+    if (b == builtin_sub) { op = "builtin_sub"; }
+    if (b == builtin_mul) { op = "builtin_mul"; }
+    if (b == builtin_lt)  { op = "builtin_lt"; }
+    if (b == builtin_gt)  { op = "builtin_gt"; }
+    if (b == builtin_lte) { op = "builtin_lte"; }
+    if (b == builtin_gte) { op = "builtin_gte"; }
+    if (b == builtin_eq)  { op = "builtin_eq"; }
+    if (b == builtin_ne)  { op = "builtin_ne"; }
+
+    if (op && args == 2) {
+        int x = tc_code(t, v->cell[1], 0, depth);
+        int y = tc_code(t, v->cell[2], 0, depth);
+        n = t->temps++;
+        tc_indent(t, depth);
+        fprintf(out, "lval* t%d = tc_op2(e, tc_k[%d], %s, t%d, t%d);\n",
+            n, k, op, x, y);
+        return n;
+    }
+
+    int a = tc_parts(t, v, 1, depth);
+
+    // a call to itself in tail position starts it again on the new
+    // arguments
+    if (tail && f == t->fun) {
+        tc_indent(t, depth);
+        fprintf(out, "if (lenv_peek(e, tc_k[%d]) == tc_v[%d] && tc_ok(%d, t%d)) {\n",
+            k, f, args, a);
+        tc_indent(t, depth + 1);
+        fprintf(out, "for (int i = 0; i < %d; i++) { lval_del(x[i]); x[i] = t%d[i]; }\n",
+            args, a);
+        tc_indent(t, depth + 1); fputs("continue;\n", out);
+        tc_indent(t, depth); fputs("}\n", out);
+    }
+
+    n = t->temps++;
+    tc_indent(t, depth);
+    if (f != -1) {
+        fprintf(out, "lval* t%d = tc_callf(e, tc_k[%d], tc_v[%d], tc_f%d, %d, t%d);\n",
+            n, k, f, f, args, a);
+    } else {
+        fprintf(out, "lval* t%d = tc_callv(e, tc_k[%d], %d, t%d);\n",
+            n, k, args, a);
+    }
+    return n;
+}
+
+// writes the c function for compiled function i, and the builtin that
+// calls it
+void tc_function(lteddyc* t, int i) {
+    FILE* out = t->out;
+    lval* l = t->funs->cell[i];
+    int n = l->cell[1]->count;
+
+    t->fun = i;
+    t->formals = l->cell[1];
+    t->temps = 0;
+
+    fprintf(out, "// %s\n", t->names->cell[i]->sym);
+    fprintf(out, "static lval* tc_f%d(lenv* e, lval** x) {\n", i);
+    fputs("    for (;;) {\n", out);
+    int r = tc_list_code(t, l->cell[2], 1, 2);
+    fprintf(out, "        for (int i = 0; i < %d; i++) { lval_del(x[i]); }\n", n);
+    fprintf(out, "        return t%d;\n", r);
+    fputs("    }\n}\n\n", out);
+
+    // called any other way, say with too few arguments to make a
+    // partial application, it's the interpreter's lambda that runs
+    fprintf(out, "static lval* tc_b%d(lenv* e, lval* a) {\n", i);
+    fprintf(out, "    if (a->count != %d) { return lval_call(e, tc_l[%d], a); }\n", n, i);
+    fputs("    while (e->par) { e = e->par; }\n", out);
+    fprintf(out, "    lval* x[%d];\n", n ? n : 1);
+    fprintf(out, "    for (int i = 0; i < %d; i++) { x[i] = lval_copy(a->cell[i]); }\n", n);
+    fputs("    lval_del(a);\n", out);
+    fprintf(out, "    return tc_f%d(e, x);\n", i);
+    fputs("}\n\n", out);
+
+    t->fun = -1;
+    t->formals = NULL;
+}
+
+// compiles the file in to c in the file out
+int teddyc(lenv* e, char* in, char* out) {
+    mpc_result_t r;
+    if (!mpc_parse_contents(in, Teddy, &r)) {
+        mpc_err_print(r.error);
+        mpc_err_delete(r.error);
+        return 1;
+    }
+
+    lval* prog = lval_read(r.output);
+    mpc_ast_delete(r.output);
+
+    lteddyc teddyc = { NULL, e, lval_qexpr(), lval_qexpr(), lval_qexpr(),
+        lval_qexpr(), lval_qexpr(), lval_qexpr(), lval_qexpr(), -1, NULL, 0 };
+    lteddyc* t = &teddyc;
+
+    for (int i = 0; i < prog->count; i++) { tc_scan(t, prog->cell[i], 1); }
+
+    // which forms define functions to compile. they're all known before
+    // any gets compiled, so calls can go straight to ones defined later
+    int fun[prog->count + 1];
+    for (int i = 0; i < prog->count; i++) {
+        fun[i] = -1;
+        if (tc_compilable(t, prog->cell[i])) {
+            fun[i] = t->funs->count;
+            lval_add(t->names, lval_copy(prog->cell[i]->cell[1]->cell[0]));
+            lval_add(t->funs, lval_copy(prog->cell[i]->cell[2]));
+        }
+    }
+
+    // the functions go to a temporary file first, since the tables
+    // they use come before them
+    t->out = tmpfile();
+    for (int i = 0; i < t->funs->count; i++) { tc_function(t, i); }
+
+    FILE* f = t->out ? fopen(out, "w") : NULL;
+    if (!f) {
+        printf("Could not write %s\n", out);
+        if (t->out) { fclose(t->out); }
+        lval_del(prog);
+        return 1;
+    }
+
+    fprintf(f, "// compiled from %s by teddyc\n\n", in);
+    fputs("#define TEDDY_LIBRARY\n#include \"parser.c\"\n\n", f);
+
+    int funs = t->funs->count;
+    fprintf(f, "lval* tc_k[%d];\n", t->syms->count + 1);
+    fprintf(f, "lval* tc_c[%d];\n", t->consts->count + 1);
+    fprintf(f, "lval* tc_l[%d];\n", funs + 1);
+    fprintf(f, "lval* tc_v[%d];\n\n", funs + 1);
+
+    for (int i = 0; i < funs; i++) {
+        fprintf(f, "static lval* tc_f%d(lenv* e, lval** x);\n", i);
+    }
+    fputc('\n', f);
+
+    rewind(t->out);
+    int c;
+    while ((c = fgetc(t->out)) != EOF) { fputc(c, f); }
+    fclose(t->out);
+    t->out = f;
+
+    fputs("int main(int argc, char** argv) {\n", f);
+    fputs("    parsers_new();\n", f);
+    fputs("    lenv* e = lenv_new();\n", f);
+    fputs("    lenv_add_builtins(e);\n\n", f);
+
+    for (int i = 0; i < t->syms->count; i++) {
+        fprintf(f, "    tc_k[%d] = ", i);
+        tc_value(f, t->syms->cell[i]);
+        fputs(";\n", f);
+    }
+    for (int i = 0; i < t->consts->count; i++) {
+        fprintf(f, "    tc_c[%d] = ", i);
+        tc_value(f, t->consts->cell[i]);
+        fputs(";\n", f);
+    }
+    fputc('\n', f);
+
+    // the forms run in order. a compiled function gets bound where its
+    // def was, along with the lambda it falls back on
+    for (int i = 0; i < prog->count; i++) {
+        lval* v = prog->cell[i];
+        int j = fun[i];
+
+        if (j == -1) {
+            fputs("    tc_top(e, ", f);
+            tc_value(f, v);
+            fputs(");\n", f);
+            continue;
+        }
+
+        fprintf(f, "    tc_l[%d] = lval_eval(e, ", j);
+        tc_value(f, v->cell[2]);
+        fputs(");\n", f);
+        fprintf(f, "    tc_v[%d] = lval_fun(tc_b%d);\n", j, j);
+        fputs("    tc_top(e, tc_list(LVAL_SEXPR, 3, ", f);
+        tc_value(f, v->cell[0]);
+        fputs(", ", f);
+        tc_value(f, v->cell[1]);
+        fprintf(f, ", lval_copy(tc_v[%d])));\n", j);
+    }
+
+    fputs("\n    lenv_del(e);\n", f);
+    fputs("    parsers_del();\n", f);
+    fputs("    return 0;\n}\n", f);
+    fclose(f);
+
+    printf("Compiled %d of the functions in %s\n", funs, in);
+
+    lval_del(prog);
+    lval_del(t->syms);
+    lval_del(t->consts);
+    lval_del(t->defined);
+    lval_del(t->local);
+    lval_del(t->macros);
+    lval_del(t->names);
+    lval_del(t->funs);
+    return 0;
+}
+
+#endif
+
+// makes the parsers for the language
+void parsers_new(void) {
     Number  = mpc_new("number");
     Symbol  = mpc_new("symbol");
     String  = mpc_new("string");
@@ -1199,14 +5176,34 @@ int main(int argc, char** argv) {
       teddy    : /^/ <expr>* /$/ ;                         \
     ",
     Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Teddy);
+}
 
-    puts("Teddy Version 0.0.0.0.1");
-    puts("Welcome to the party!");
-    puts("Press Ctrl+c to Exit\n");
+void parsers_del(void) {
+    mpc_cleanup(8,
+        Number, Symbol, String, Comment,
+        Sexpr, Qexpr, Expr, Teddy);
+}
+
+#ifndef TEDDY_LIBRARY
+
+int main(int argc, char** argv) {
+    parsers_new();
 
     lenv* e = lenv_new();
     lenv_add_builtins(e);
 
+    // parsing --teddyc prog.tdy prog.c compiles prog.tdy to c
+    if (argc == 4 && strcmp(argv[1], "--teddyc") == 0) {
+        int r = teddyc(e, argv[2], argv[3]);
+        lenv_del(e);
+        parsers_del();
+        return r;
+    }
+
+    puts("Teddy Version 0.0.0.0.1");
+    puts("Welcome to the party!");
+    puts("Press Ctrl+c to Exit\n");
+
     while(1) {
 
         char* input = readline("teddycat> ");
@@ -1219,6 +5216,9 @@ int main(int argc, char** argv) {
             lval_println(x);
             lval_del(x);
             mpc_ast_delete(r.output);
+
+            // nothing is being evaluated here, so it's safe to collect
+            if (gc_allocs > GC_THRESHOLD) { gc_collect(e); }
         } else {
             // else print the error
             mpc_err_print(r.error);
@@ -1246,9 +5246,9 @@ int main(int argc, char** argv) {
     lenv_del(e);
 
     // undefined and delete the parsers
-    mpc_cleanup(8, 
-        Number, Symbol, String, Comment, 
-        Sexpr, Qexpr, Expr, Teddy);
+    parsers_del();
 
     return 0;
 }
+
+#endif